@@ -0,0 +1,384 @@
+#include "FMatrixStore.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEBUG_STRING "FMatrixStore: "
+#define DEBUG_LEVEL 0
+#include "debug.h"
+
+typedef FMatrixStore::index_t index_t;
+typedef FMatrixStore::offset_t offset_t;
+
+// file header (followed by column_ptr and rows)
+namespace {
+    struct FileHeader {
+        char magic[8];
+        std::uint64_t signature;
+        std::int32_t n_rows, n_cols;
+        std::uint64_t column_ptr_n, rows_n;
+    };
+    const char file_magic[8] = {'A','T','E','M','F','M','S','1'};
+    // segment files of SegmentWriter
+    std::string segment_column_file(const std::string & name) {return name+".columns";}
+    std::string segment_row_file(const std::string & name) {return name+".rows";}
+    // size of an open file in units of T
+    template<class T>
+    std::uint64_t file_elements(FILE * file) {
+        if(fseek(file,0,SEEK_END)!=0) return 0;
+        long size = ftell(file);
+        rewind(file);
+        return size<0 ? 0 : size/sizeof(T);
+    }
+    // copy n elements of T from one file to another via the buffer
+    template<class T>
+    bool copy_elements(FILE * from, FILE * to, std::uint64_t n, std::vector<T> & buffer) {
+        while(n>0) {
+            std::size_t read_n = std::min<std::uint64_t>(n,buffer.size());
+            if(fread(buffer.data(),sizeof(T),read_n,from)!=read_n ||
+               fwrite(buffer.data(),sizeof(T),read_n,to)!=read_n) return false;
+            n -= read_n;
+        }
+        return true;
+    }
+}
+
+FMatrixStore::Matrix::Matrix(const offset_t * column_ptr,
+                             const index_t * rows,
+                             int n_rows,
+                             int n_cols):
+    column_ptr(column_ptr),
+    rows(rows),
+    rows_n(n_rows),
+    cols_n(n_cols)
+{}
+
+double FMatrixStore::Matrix::operator()(int row, int col) const {
+    DEBUG_EXPECT(row>=0 && row<rows_n);
+    DEBUG_EXPECT(col>=0 && col<cols_n);
+    // row indices are sorted within each column
+    return std::binary_search(begin(col),end(col),row) ? 1 : 0;
+}
+
+void FMatrixStore::Matrix::transposed_product(const double * weights, double * lin) const {
+    for(int col=0; col<cols_n; ++col) {
+        double sum = 0;
+        for(auto row_ptr=begin(col); row_ptr!=end(col); ++row_ptr) {
+            sum += weights[*row_ptr];
+        }
+        lin[col] = sum;
+    }
+}
+
+void FMatrixStore::Matrix::add_product(const double * factors, double * result) const {
+    for(int col=0; col<cols_n; ++col) {
+        const double factor = factors[col];
+        for(auto row_ptr=begin(col); row_ptr!=end(col); ++row_ptr) {
+            result[*row_ptr] += factor;
+        }
+    }
+}
+
+std::size_t FMatrixStore::Matrix::hash() const {
+    // FNV-1a over the number of entries and the row indices of each column
+    std::size_t h = 14695981039346656037ull;
+    for(int col=0; col<cols_n; ++col) {
+        h ^= (std::size_t)(end(col)-begin(col));
+        h *= 1099511628211ull;
+        for(auto row_ptr=begin(col); row_ptr!=end(col); ++row_ptr) {
+            h ^= (std::size_t)*row_ptr;
+            h *= 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+bool FMatrixStore::Matrix::operator==(const Matrix & other) const {
+    if(rows_n!=other.rows_n || cols_n!=other.cols_n) return false;
+    for(int col=0; col<cols_n; ++col) {
+        if(end(col)-begin(col)!=other.end(col)-other.begin(col) ||
+           !std::equal(begin(col),end(col),other.begin(col))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FMatrixStore::FMatrixStore(int n_rows, int n_cols) {
+    reset(n_rows,n_cols);
+}
+
+void FMatrixStore::reset(int n_rows, int n_cols) {
+    rows_n = n_rows;
+    cols_n = n_cols;
+    column_ptr.assign(1,0);
+    rows.clear();
+    mapping.reset();
+    mapped_column_ptr = nullptr;
+    mapped_rows = nullptr;
+    mapped_column_ptr_n = 0;
+    mapped_rows_n = 0;
+}
+
+void FMatrixStore::append(const FMatrixStore & other) {
+    DEBUG_EXPECT(other.rows_n==rows_n);
+    DEBUG_EXPECT(other.cols_n==cols_n);
+    DEBUG_EXPECT(!is_mapped());
+    const offset_t offset = rows.size();
+    const offset_t * other_column_ptr = other.column_data();
+    const offset_t other_column_ptr_n = other.column_data_size();
+    rows.insert(rows.end(),other.row_data(),other.row_data()+other.non_zero());
+    column_ptr.reserve(column_ptr.size()+other_column_ptr_n-1);
+    for(offset_t idx=1; idx<other_column_ptr_n; ++idx) {
+        column_ptr.push_back(other_column_ptr[idx]+offset);
+    }
+}
+
+void FMatrixStore::assemble(const std::vector<FMatrixStore> & stores) {
+    // reserve memory first to avoid reallocation
+    offset_t rows_size = 0;
+    offset_t column_ptr_size = 1;
+    for(auto & store : stores) {
+        rows_size += store.non_zero();
+        column_ptr_size += store.column_data_size()-1;
+    }
+    reset(rows_n,cols_n);
+    rows.reserve(rows_size);
+    column_ptr.reserve(column_ptr_size);
+    for(auto & store : stores) {
+        append(store);
+    }
+}
+
+int FMatrixStore::size() const {
+    if(cols_n==0) return 0;
+    return (column_data_size()-1)/cols_n;
+}
+
+std::size_t FMatrixStore::memory() const {
+    return column_ptr.capacity()*sizeof(offset_t) + rows.capacity()*sizeof(index_t);
+}
+
+FMatrixStore::Matrix FMatrixStore::operator[](int idx) const {
+    DEBUG_EXPECT(idx>=0 && idx<size());
+    return Matrix(column_data()+idx*(offset_t)cols_n,
+                  row_data(),
+                  rows_n,
+                  cols_n);
+}
+
+FMatrixStore::Matrix FMatrixStore::block(int first, int last) const {
+    DEBUG_EXPECT(first>=0 && first<=last && last<=size());
+    return Matrix(column_data()+first*(offset_t)cols_n,
+                  row_data(),
+                  rows_n,
+                  (last-first)*cols_n);
+}
+
+bool FMatrixStore::save(const std::string & file_name, std::uint64_t signature) const {
+    const FMatrixStore * store = this;
+    return save(&store,1,file_name,signature);
+}
+
+FMatrixStore::SegmentWriter::SegmentWriter(const std::string & file_name):
+    column_file(fopen(segment_column_file(file_name).c_str(),"wb")),
+    row_file(fopen(segment_row_file(file_name).c_str(),"wb"))
+{
+    if(column_file==nullptr || row_file==nullptr) {
+        DEBUG_WARNING("Could not open segment '" << file_name << "' for writing");
+        ok = false;
+    }
+}
+
+FMatrixStore::SegmentWriter::~SegmentWriter() {
+    close();
+}
+
+bool FMatrixStore::SegmentWriter::write(FMatrixStore & store) {
+    DEBUG_EXPECT(!store.is_mapped());
+    if(ok) {
+        // column pointers (without the leading zero) relative to the start
+        // of the segment
+        DEBUG_EXPECT(store.size()*(offset_t)store.cols_n+1==store.column_ptr.size());
+        const offset_t column_n = store.column_ptr.size()-1;
+        const offset_t rows_n = store.rows.size();
+        std::vector<offset_t> & buffer = store.column_ptr;
+        for(offset_t idx=1; idx<=column_n; ++idx) buffer[idx] += offset;
+        ok = fwrite(buffer.data()+1,sizeof(offset_t),column_n,column_file)==column_n &&
+            fwrite(store.rows.data(),sizeof(index_t),rows_n,row_file)==rows_n;
+        offset += rows_n;
+    }
+    store.reset(store.rows_n,store.cols_n);
+    return ok;
+}
+
+bool FMatrixStore::SegmentWriter::close() {
+    if(column_file!=nullptr) ok = fclose(column_file)==0 && ok;
+    if(row_file!=nullptr) ok = fclose(row_file)==0 && ok;
+    column_file = nullptr;
+    row_file = nullptr;
+    return ok;
+}
+
+bool FMatrixStore::concatenate(const std::vector<std::string> & segment_names,
+                               int n_rows,
+                               int n_cols,
+                               const std::string & file_name,
+                               std::uint64_t signature) {
+    int segment_n = segment_names.size();
+    std::vector<FILE*> column_files(segment_n), row_files(segment_n);
+    std::vector<std::uint64_t> column_ns(segment_n,0), row_ns(segment_n,0);
+    FileHeader header;
+    std::memcpy(header.magic,file_magic,sizeof(file_magic));
+    header.signature = signature;
+    header.n_rows = n_rows;
+    header.n_cols = n_cols;
+    header.column_ptr_n = 1;
+    header.rows_n = 0;
+    bool ok = true;
+    for(int segment_idx=0; segment_idx<segment_n; ++segment_idx) {
+        column_files[segment_idx] = fopen(segment_column_file(segment_names[segment_idx]).c_str(),"rb");
+        row_files[segment_idx] = fopen(segment_row_file(segment_names[segment_idx]).c_str(),"rb");
+        if(column_files[segment_idx]==nullptr || row_files[segment_idx]==nullptr) {
+            DEBUG_WARNING("Could not open segment '" << segment_names[segment_idx] << "'");
+            ok = false;
+            continue;
+        }
+        column_ns[segment_idx] = file_elements<offset_t>(column_files[segment_idx]);
+        row_ns[segment_idx] = file_elements<index_t>(row_files[segment_idx]);
+        header.column_ptr_n += column_ns[segment_idx];
+        header.rows_n += row_ns[segment_idx];
+    }
+    FILE * file = ok ? fopen(file_name.c_str(),"wb") : nullptr;
+    if(ok && file==nullptr) {
+        DEBUG_WARNING("Could not open '" << file_name << "' for writing");
+        ok = false;
+    }
+    if(ok) {
+        ok = fwrite(&header,sizeof(header),1,file)==1;
+        // column pointers (shifted by the number of preceding non-zero
+        // entries)
+        offset_t offset = 0;
+        std::vector<offset_t> buffer(1<<16,0);
+        ok = ok && fwrite(buffer.data(),sizeof(offset_t),1,file)==1;
+        for(int segment_idx=0; ok && segment_idx<segment_n; ++segment_idx) {
+            for(std::uint64_t done=0; ok && done<column_ns[segment_idx]; done+=buffer.size()) {
+                std::size_t read_n = std::min<std::uint64_t>(column_ns[segment_idx]-done,buffer.size());
+                ok = fread(buffer.data(),sizeof(offset_t),read_n,column_files[segment_idx])==read_n;
+                for(std::size_t idx=0; idx<read_n; ++idx) buffer[idx] += offset;
+                ok = ok && fwrite(buffer.data(),sizeof(offset_t),read_n,file)==read_n;
+            }
+            offset += row_ns[segment_idx];
+        }
+        // row indices
+        std::vector<index_t> row_buffer(1<<16);
+        for(int segment_idx=0; ok && segment_idx<segment_n; ++segment_idx) {
+            ok = copy_elements(row_files[segment_idx],file,row_ns[segment_idx],row_buffer);
+        }
+        ok = fclose(file)==0 && ok;
+        if(!ok) {
+            DEBUG_WARNING("Could not write '" << file_name << "'");
+        }
+    }
+    for(int segment_idx=0; segment_idx<segment_n; ++segment_idx) {
+        if(column_files[segment_idx]!=nullptr) fclose(column_files[segment_idx]);
+        if(row_files[segment_idx]!=nullptr) fclose(row_files[segment_idx]);
+        std::remove(segment_column_file(segment_names[segment_idx]).c_str());
+        std::remove(segment_row_file(segment_names[segment_idx]).c_str());
+    }
+    return ok;
+}
+
+bool FMatrixStore::save(const FMatrixStore * const * stores,
+                        int store_n,
+                        const std::string & file_name,
+                        std::uint64_t signature) {
+    FileHeader header;
+    std::memcpy(header.magic,file_magic,sizeof(file_magic));
+    header.signature = signature;
+    header.n_rows = store_n==0 ? 0 : stores[0]->rows_n;
+    header.n_cols = store_n==0 ? 0 : stores[0]->cols_n;
+    header.column_ptr_n = 1;
+    header.rows_n = 0;
+    for(int store_idx=0; store_idx<store_n; ++store_idx) {
+        header.column_ptr_n += stores[store_idx]->column_data_size()-1;
+        header.rows_n += stores[store_idx]->non_zero();
+    }
+    FILE * file = fopen(file_name.c_str(),"wb");
+    if(file==nullptr) {
+        DEBUG_WARNING("Could not open '" << file_name << "' for writing");
+        return false;
+    }
+    bool ok = fwrite(&header,sizeof(header),1,file)==1;
+    // column pointers (shifted by the number of preceding non-zero entries)
+    offset_t offset = 0;
+    std::vector<offset_t> buffer(1,0);
+    ok = ok && fwrite(buffer.data(),sizeof(offset_t),1,file)==1;
+    for(int store_idx=0; store_idx<store_n; ++store_idx) {
+        const auto & store = *stores[store_idx];
+        const offset_t * store_column_ptr = store.column_data();
+        buffer.assign(store_column_ptr+1,store_column_ptr+store.column_data_size());
+        for(auto & ptr : buffer) ptr += offset;
+        ok = ok && fwrite(buffer.data(),sizeof(offset_t),buffer.size(),file)==buffer.size();
+        offset += store.non_zero();
+    }
+    // row indices
+    for(int store_idx=0; store_idx<store_n; ++store_idx) {
+        const auto & store = *stores[store_idx];
+        ok = ok && fwrite(store.row_data(),sizeof(index_t),store.non_zero(),file)==store.non_zero();
+    }
+    ok = fclose(file)==0 && ok;
+    if(!ok) {
+        DEBUG_WARNING("Could not write '" << file_name << "'");
+    }
+    return ok;
+}
+
+bool FMatrixStore::map(const std::string & file_name,
+                       std::uint64_t signature,
+                       int n_rows,
+                       int n_cols) {
+    int fd = open(file_name.c_str(),O_RDONLY);
+    if(fd<0) return false;
+    struct stat file_stat;
+    if(fstat(fd,&file_stat)!=0 || (std::size_t)file_stat.st_size<sizeof(FileHeader)) {
+        close(fd);
+        return false;
+    }
+    std::size_t length = file_stat.st_size;
+    void * address = mmap(nullptr,length,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(address==MAP_FAILED) return false;
+    std::shared_ptr<const char> new_mapping((const char*)address,
+                                            [length](const char * ptr){munmap((void*)ptr,length);});
+    // check header
+    FileHeader header;
+    std::memcpy(&header,address,sizeof(header));
+    if(std::memcmp(header.magic,file_magic,sizeof(file_magic))!=0 ||
+       header.signature!=signature ||
+       header.column_ptr_n<1 ||
+       length!=sizeof(header)+header.column_ptr_n*sizeof(offset_t)+header.rows_n*sizeof(index_t)) {
+        DEBUG_OUT(1,"'" << file_name << "' does not match");
+        return false;
+    }
+    if((n_rows>=0 && header.n_rows!=n_rows) || (n_cols>=0 && header.n_cols!=n_cols)) {
+        DEBUG_WARNING("'" << file_name << "' has " << header.n_rows << "x" << header.n_cols
+                      << " matrices instead of " << n_rows << "x" << n_cols);
+        return false;
+    }
+    madvise(address,length,MADV_SEQUENTIAL);
+    // use mapped data
+    reset(header.n_rows,header.n_cols);
+    mapping = new_mapping;
+    mapped_column_ptr = (const offset_t*)(mapping.get()+sizeof(header));
+    mapped_column_ptr_n = header.column_ptr_n;
+    mapped_rows = (const index_t*)(mapping.get()+sizeof(header)+header.column_ptr_n*sizeof(offset_t));
+    mapped_rows_n = header.rows_n;
+    return true;
+}
@@ -0,0 +1,171 @@
+#ifndef F_MATRIX_STORE_H_
+#define F_MATRIX_STORE_H_
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Compact storage for the F-matrices of many data points.
+ *
+ * The entries of \f$\mathbf{F}(\mathbf{x})\f$ are either zero or one and for
+ * larger feature sets almost all of them are zero. Instead of dense matrices
+ * we therefore only store the row (feature) indices of the non-zero entries
+ * column by column (outcome by outcome). The columns of all matrices are
+ * concatenated into a single contiguous array (compressed sparse column
+ * format) so that there are no per-matrix allocations and the products
+ * \f$\boldsymbol{\mathbf{\theta}}^{\top}\mathbf{F}\f$ and
+ * \f$\mathbf{F}\,\mathbf{v}\f$ become sparse gathers/scatters.
+ *
+ * Matrices are built by appending: push_back() the row indices of the
+ * non-zero entries of a column (in increasing order) and terminate the column
+ * with end_column(). After n_cols() columns the matrix is complete.
+ *
+ * For data sets that do not fit into memory the matrices can be written to a
+ * file with save() and memory-mapped with map(). Matrices that are produced
+ * in parallel can be written to segment files as they are produced (see
+ * SegmentWriter), which are then combined with concatenate(), so that only
+ * the matrices not yet written are held in memory. A mapped store is read-only
+ * (until the next reset()) and its pages are loaded and evicted by the
+ * operating system as the matrices are accessed (sequential access is
+ * advised). Files carry a signature chosen by the caller (e.g. a hash of the
+ * data and features) so that stale files are recognized.
+ */
+class FMatrixStore {
+
+    //----typdefs/classes----//
+public:
+    typedef int index_t;
+    typedef std::size_t offset_t;
+    /**
+     * Read-only view of a single matrix within the store. */
+    class Matrix {
+    public:
+        Matrix(const offset_t * column_ptr, const index_t * rows, int n_rows, int n_cols);
+        /** Entry (0 or 1) in given row and column. */
+        double operator()(int row, int col) const;
+        /** First row index of non-zero entries in given column. */
+        const index_t * begin(int col) const {return rows+column_ptr[col];}
+        /** One past the last row index of non-zero entries in given column. */
+        const index_t * end(int col) const {return rows+column_ptr[col+1];}
+        int n_rows() const {return rows_n;}
+        int n_cols() const {return cols_n;}
+        /** Computes lin = weightsᵀ·F with lin of size n_cols(). */
+        void transposed_product(const double * weights, double * lin) const;
+        /** Adds F·factors to result with factors of size n_cols(). */
+        void add_product(const double * factors, double * result) const;
+        /** Hash of the non-zero entries. */
+        std::size_t hash() const;
+        /** Whether both matrices have the same non-zero entries. */
+        bool operator==(const Matrix & other) const;
+    private:
+        const offset_t * column_ptr;
+        const index_t * rows;
+        int rows_n, cols_n;
+    };
+    /**
+     * Writes matrices to a segment (a pair of files for column pointers and
+     * row indices next to the given file name) as they are produced.
+     * Segments are combined into a single file by concatenate(). */
+    class SegmentWriter {
+    public:
+        SegmentWriter(const std::string & file_name);
+        ~SegmentWriter();
+        SegmentWriter(const SegmentWriter &) = delete;
+        SegmentWriter & operator=(const SegmentWriter &) = delete;
+        /**
+         * Write all matrices of the given store (which must be complete and
+         * in memory) and remove them from the store. Returns false on
+         * failure. */
+        bool write(FMatrixStore & store);
+        /** Close the files. Returns false if any write failed. */
+        bool close();
+    private:
+        FILE * column_file = nullptr;
+        FILE * row_file = nullptr;
+        offset_t offset = 0;            ///< Row indices written so far
+        bool ok = true;
+    };
+
+    //----members----//
+protected:
+    int rows_n = 0;                     ///< Number of rows (features)
+    int cols_n = 0;                     ///< Number of columns (outcomes)
+    std::vector<offset_t> column_ptr;   ///< Start of column i at
+                                        ///column_ptr[i], end at
+                                        ///column_ptr[i+1]
+    std::vector<index_t> rows;          ///< Row indices of non-zero entries
+    std::shared_ptr<const char> mapping;///< Memory-mapped file (null if
+                                        ///matrices are held in memory)
+    const offset_t * mapped_column_ptr = nullptr; ///< column_ptr in mapping
+    const index_t * mapped_rows = nullptr;        ///< rows in mapping
+    offset_t mapped_column_ptr_n = 0;   ///< Size of mapped column_ptr
+    offset_t mapped_rows_n = 0;         ///< Size of mapped rows
+
+    //----methods----//
+public:
+    FMatrixStore(int n_rows = 0, int n_cols = 0);
+    virtual ~FMatrixStore() = default;
+    /**
+     * Remove all matrices (unmapping a mapped file) and set the matrix
+     * dimensions. */
+    void reset(int n_rows, int n_cols);
+    /** Add a non-zero entry in the given row to the current column. */
+    void push_back(index_t row) {rows.push_back(row);}
+    /** Terminate the current column. */
+    void end_column() {column_ptr.push_back(rows.size());}
+    /** Append all matrices of another store (with same dimensions). */
+    void append(const FMatrixStore & other);
+    /** Concatenate the given stores (in order) into this one. */
+    void assemble(const std::vector<FMatrixStore> & stores);
+    /** Number of complete matrices. */
+    int size() const;
+    int n_rows() const {return rows_n;}
+    int n_cols() const {return cols_n;}
+    /** Total number of non-zero entries. */
+    offset_t non_zero() const {return mapping?mapped_rows_n:rows.size();}
+    /** Approximate memory consumption in bytes (excluding mapped files). */
+    std::size_t memory() const;
+    Matrix operator[](int idx) const;
+    /**
+     * View of the consecutive matrices first...last-1 side by side as a
+     * single matrix with (last-first)·n_cols() columns. Products with a block
+     * run the same per-column sparse loops as for a single matrix (there is
+     * no batched kernel), only in one call over contiguous memory. */
+    Matrix block(int first, int last) const;
+    /** Whether the matrices are in a memory-mapped file. */
+    bool is_mapped() const {return (bool)mapping;}
+    /** Write all matrices to a file. Returns false on failure. */
+    bool save(const std::string & file_name, std::uint64_t signature) const;
+    /**
+     * Write the concatenation of the given segments (see SegmentWriter) to a
+     * file, streaming them without holding them in memory, and remove the
+     * segment files. Returns false on failure. */
+    static bool concatenate(const std::vector<std::string> & segment_names,
+                            int n_rows,
+                            int n_cols,
+                            const std::string & file_name,
+                            std::uint64_t signature);
+    /**
+     * Replace the matrices by those in the given file, which is
+     * memory-mapped. Returns false (leaving the store unchanged) if the file
+     * cannot be mapped, its signature does not match, or its matrices do not
+     * have the given dimensions (negative values accept any). */
+    bool map(const std::string & file_name,
+             std::uint64_t signature,
+             int n_rows = -1,
+             int n_cols = -1);
+protected:
+    static bool save(const FMatrixStore * const * stores,
+                     int store_n,
+                     const std::string & file_name,
+                     std::uint64_t signature);
+    const offset_t * column_data() const {return mapping?mapped_column_ptr:column_ptr.data();}
+    offset_t column_data_size() const {return mapping?mapped_column_ptr_n:column_ptr.size();}
+    const index_t * row_data() const {return mapping?mapped_rows:rows.data();}
+};
+
+#endif /* F_MATRIX_STORE_H_ */
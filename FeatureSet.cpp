@@ -0,0 +1,166 @@
+#include "FeatureSet.h"
+
+#include <algorithm>
+
+#define DEBUG_STRING "FeatureSet: "
+#define DEBUG_LEVEL 0
+#include "debug.h"
+
+typedef FeatureSet::basis_idx_t basis_idx_t;
+
+FeatureSet::FeatureSet() {
+    clear();
+}
+
+void FeatureSet::clear() {
+    feature_ptr.assign(1,0);
+    basis_pool.clear();
+    weight_vector.clear();
+    id_vector.clear();
+    hash_vector.clear();
+    hash_table.assign(16,-1);
+}
+
+basis_idx_t FeatureSet::intern(const basis_feature_t & basis_feature) {
+    auto it = basis_lookup.find(basis_feature);
+    if(it!=basis_lookup.end()) return it->second;
+    basis_idx_t basis_idx = basis_table.size();
+    basis_table.push_back(basis_feature);
+    basis_lookup[basis_feature] = basis_idx;
+    return basis_idx;
+}
+
+basis_idx_t FeatureSet::basis_index(const basis_feature_t & basis_feature) const {
+    auto it = basis_lookup.find(basis_feature);
+    if(it!=basis_lookup.end()) return it->second;
+    return -1;
+}
+
+void FeatureSet::canonicalize(std::vector<basis_idx_t> & basis) const {
+    std::sort(basis.begin(),basis.end(),
+              [this](basis_idx_t a, basis_idx_t b){return basis_less(a,b);});
+    basis.erase(std::unique(basis.begin(),basis.end()),basis.end());
+}
+
+bool FeatureSet::is_contradictory(const basis_idx_t * begin, const basis_idx_t * end) const {
+    for(auto basis_ptr=begin; basis_ptr+1<end; ++basis_ptr) {
+        const auto & first = basis_table[*basis_ptr];
+        const auto & second = basis_table[*(basis_ptr+1)];
+        if(std::get<0>(first)==std::get<0>(second) &&
+           std::get<1>(first)==std::get<1>(second) &&
+           std::get<2>(first)!=std::get<2>(second)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FeatureSet::refers_to_outcome(const basis_idx_t * begin, const basis_idx_t * end) const {
+    for(auto basis_ptr=begin; basis_ptr<end; ++basis_ptr) {
+        const auto & basis_feature = basis_table[*basis_ptr];
+        if(std::get<1>(basis_feature)==0 &&
+           (std::get<0>(basis_feature)==OBSERVATION || std::get<0>(basis_feature)==REWARD)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int FeatureSet::find(const basis_idx_t * begin, const basis_idx_t * end) const {
+    const std::size_t h = hash(begin,end);
+    const std::size_t mask = hash_table.size()-1;
+    for(std::size_t slot=h&mask; hash_table[slot]>=0; slot=(slot+1)&mask) {
+        int feature_idx = hash_table[slot];
+        if(hash_vector[feature_idx]==h) {
+            auto feature = (*this)[feature_idx];
+            if(feature.size()==end-begin && std::equal(begin,end,feature.begin())) {
+                return feature_idx;
+            }
+        }
+    }
+    return -1;
+}
+
+int FeatureSet::insert(const basis_idx_t * begin, const basis_idx_t * end, double weight) {
+    DEBUG_EXPECT(std::is_sorted(begin,end,[this](basis_idx_t a, basis_idx_t b){return basis_less(a,b);}));
+    int feature_idx = find(begin,end);
+    if(feature_idx>=0) return feature_idx;
+    // append
+    feature_idx = size();
+    basis_pool.insert(basis_pool.end(),begin,end);
+    feature_ptr.push_back(basis_pool.size());
+    weight_vector.push_back(weight);
+    id_vector.push_back(next_id++);
+    hash_vector.push_back(hash(begin,end));
+    // keep load factor below 1/2
+    if(2*(std::size_t)size()>hash_table.size()) {
+        rehash(2*hash_table.size());
+    } else {
+        const std::size_t mask = hash_table.size()-1;
+        std::size_t slot = hash_vector.back()&mask;
+        while(hash_table[slot]>=0) slot = (slot+1)&mask;
+        hash_table[slot] = feature_idx;
+    }
+    return feature_idx;
+}
+
+void FeatureSet::reserve(int feature_n, std::size_t basis_n) {
+    feature_n += size();
+    feature_ptr.reserve(feature_n+1);
+    basis_pool.reserve(basis_pool.size()+basis_n);
+    weight_vector.reserve(feature_n);
+    id_vector.reserve(feature_n);
+    hash_vector.reserve(feature_n);
+    std::size_t slot_n = hash_table.size();
+    while(2*(std::size_t)feature_n>slot_n) slot_n *= 2;
+    if(slot_n>hash_table.size()) rehash(slot_n);
+}
+
+void FeatureSet::erase(const std::vector<bool> & keep) {
+    DEBUG_EXPECT((int)keep.size()==size());
+    int new_idx = 0;
+    std::size_t pool_idx = 0;
+    for(int feature_idx=0; feature_idx<size(); ++feature_idx) {
+        if(!keep[feature_idx]) continue;
+        for(std::size_t ptr=feature_ptr[feature_idx]; ptr<feature_ptr[feature_idx+1]; ++ptr) {
+            basis_pool[pool_idx++] = basis_pool[ptr];
+        }
+        feature_ptr[new_idx+1] = pool_idx;
+        weight_vector[new_idx] = weight_vector[feature_idx];
+        id_vector[new_idx] = id_vector[feature_idx];
+        hash_vector[new_idx] = hash_vector[feature_idx];
+        ++new_idx;
+    }
+    feature_ptr.resize(new_idx+1);
+    basis_pool.resize(pool_idx);
+    weight_vector.resize(new_idx);
+    id_vector.resize(new_idx);
+    hash_vector.resize(new_idx);
+    rehash(hash_table.size());
+}
+
+FeatureSet::Feature FeatureSet::operator[](int feature_idx) const {
+    DEBUG_EXPECT(feature_idx>=0 && feature_idx<size());
+    const basis_idx_t * pool = basis_pool.data();
+    return Feature(pool+feature_ptr[feature_idx],pool+feature_ptr[feature_idx+1]);
+}
+
+std::size_t FeatureSet::hash(const basis_idx_t * begin, const basis_idx_t * end) {
+    // FNV-1a over the basis feature indices
+    std::size_t h = 14695981039346656037ull;
+    for(auto basis_ptr=begin; basis_ptr!=end; ++basis_ptr) {
+        h ^= (std::size_t)*basis_ptr;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+void FeatureSet::rehash(std::size_t slot_n) {
+    hash_table.assign(slot_n,-1);
+    const std::size_t mask = slot_n-1;
+    for(int feature_idx=0; feature_idx<size(); ++feature_idx) {
+        std::size_t slot = hash_vector[feature_idx]&mask;
+        while(hash_table[slot]>=0) slot = (slot+1)&mask;
+        hash_table[slot] = feature_idx;
+    }
+}
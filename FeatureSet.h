@@ -0,0 +1,122 @@
+#ifndef FEATURE_SET_H_
+#define FEATURE_SET_H_
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include <cstddef>
+
+/**
+ * Flat feature set with interned basis features.
+ *
+ * A feature is a conjunction of basis features, each of which is given by a
+ * type (action, observation, reward), a time offset, and a value. Basis
+ * features are interned, that is, they are stored once in a table and
+ * referred to by their index. A feature is an array of basis feature indices
+ * and the arrays of all features are concatenated into one contiguous pool.
+ * Weights are kept in a separate vector. Features are looked up via an
+ * open-addressing hash table so that expanding, looking up, and iterating
+ * over features does not allocate (apart from amortized growth of the
+ * arrays).
+ *
+ * Basis features within a feature are ordered by (type, time, value), so
+ * contradictory basis features (same type and time but different values) are
+ * adjacent. Features are kept in insertion order and erase() preserves the
+ * order of the remaining features. Every inserted feature gets a unique id
+ * that is never reused, which allows to keep track of features across
+ * insertions and removals.
+ */
+class FeatureSet {
+
+    //----typdefs/classes----//
+public:
+    enum FEATURE_TYPE { ACTION, OBSERVATION, REWARD };
+    typedef std::tuple<FEATURE_TYPE,int,double> basis_feature_t;
+    typedef int basis_idx_t;
+    typedef long id_t;
+    /**
+     * Read-only view of the (sorted) basis feature indices of a feature. The
+     * view is invalidated by inserting or erasing features. */
+    class Feature {
+    public:
+        Feature(const basis_idx_t * begin, const basis_idx_t * end): b(begin), e(end) {}
+        const basis_idx_t * begin() const {return b;}
+        const basis_idx_t * end() const {return e;}
+        int size() const {return e-b;}
+        basis_idx_t operator[](int idx) const {return b[idx];}
+    private:
+        const basis_idx_t * b;
+        const basis_idx_t * e;
+    };
+
+    //----members----//
+protected:
+    std::vector<basis_feature_t> basis_table;           ///< Interned basis
+                                                        ///features
+    std::map<basis_feature_t,basis_idx_t> basis_lookup; ///< Index of basis
+                                                        ///features in table
+    std::vector<std::size_t> feature_ptr;               ///< Feature i in
+                                                        ///[feature_ptr[i],feature_ptr[i+1])
+                                                        ///of basis_pool
+    std::vector<basis_idx_t> basis_pool;                ///< Basis feature
+                                                        ///indices of all
+                                                        ///features
+    std::vector<double> weight_vector;                  ///< Feature weights
+    std::vector<id_t> id_vector;                        ///< Unique feature ids
+    std::vector<std::size_t> hash_vector;               ///< Feature hashes
+    std::vector<int> hash_table;                        ///< Feature indices
+                                                        ///(-1 for empty slots)
+    id_t next_id = 0;                                   ///< Id of next
+                                                        ///inserted feature
+
+    //----methods----//
+public:
+    FeatureSet();
+    virtual ~FeatureSet() = default;
+    /** Remove all features (interned basis features are kept). */
+    void clear();
+    int size() const {return weight_vector.size();}
+    bool empty() const {return weight_vector.empty();}
+    /** Index of given basis feature (which is added if it is new). */
+    basis_idx_t intern(const basis_feature_t & basis_feature);
+    /** Index of given basis feature or -1 if it does not exist. */
+    basis_idx_t basis_index(const basis_feature_t & basis_feature) const;
+    const basis_feature_t & basis_feature(basis_idx_t basis_idx) const {return basis_table[basis_idx];}
+    int basis_feature_number() const {return basis_table.size();}
+    /** Whether basis feature a comes before b in the canonical order. */
+    bool basis_less(basis_idx_t a, basis_idx_t b) const {return basis_table[a]<basis_table[b];}
+    /** Sort basis features into canonical order and remove duplicates. */
+    void canonicalize(std::vector<basis_idx_t> & basis) const;
+    /** Whether the canonically ordered basis features are contradictory. */
+    bool is_contradictory(const basis_idx_t * begin, const basis_idx_t * end) const;
+    /**
+     * Whether any of the basis features refers to the outcome (observation or
+     * reward at time 0). Features that do not are constant across outcomes. */
+    bool refers_to_outcome(const basis_idx_t * begin, const basis_idx_t * end) const;
+    /**
+     * Index of the feature with given (canonically ordered) basis features or
+     * -1 if it does not exist. */
+    int find(const basis_idx_t * begin, const basis_idx_t * end) const;
+    /**
+     * Insert a feature with given (canonically ordered) basis features and
+     * return its index. If the feature already exists it remains unchanged. */
+    int insert(const basis_idx_t * begin, const basis_idx_t * end, double weight = 0);
+    /**
+     * Reserve memory for feature_n additional features with a total of
+     * basis_n basis features so that inserting them does not reallocate. */
+    void reserve(int feature_n, std::size_t basis_n);
+    /** Remove all features with keep[feature_idx]==false. */
+    void erase(const std::vector<bool> & keep);
+    Feature operator[](int feature_idx) const;
+    double & weight(int feature_idx) {return weight_vector[feature_idx];}
+    double weight(int feature_idx) const {return weight_vector[feature_idx];}
+    std::vector<double> & weights() {return weight_vector;}
+    const std::vector<double> & weights() const {return weight_vector;}
+    id_t id(int feature_idx) const {return id_vector[feature_idx];}
+protected:
+    static std::size_t hash(const basis_idx_t * begin, const basis_idx_t * end);
+    /** Rebuild the hash table with given number of slots (power of two). */
+    void rehash(std::size_t slot_n);
+};
+
+#endif /* FEATURE_SET_H_ */
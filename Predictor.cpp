@@ -0,0 +1,109 @@
+#include "Predictor.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define DEBUG_STRING "Predictor: "
+#define DEBUG_LEVEL 0
+#include "debug.h"
+
+using std::vector;
+
+Predictor::Predictor(const TemporallyExtendedModel & model) {
+    DEBUG_OUT(2,"Compiling model");
+    const auto & feature_set = model.feature_set;
+    // outcomes in the same order as F-matrix columns
+    outcome_observations = model.outcome_observations;
+    outcome_rewards = model.outcome_rewards;
+    outcome_slot = model.outcome_slot;
+    // plan all features
+    vector<int> features(feature_set.size());
+    for(int feature_idx=0; feature_idx<(int)features.size(); ++feature_idx) {
+        features[feature_idx] = feature_idx;
+    }
+    TemporallyExtendedModel::FeaturePlan plan;
+    model.plan_features(features,plan);
+    // deduplicate conditions (basis features referring to the history)
+    vector<int> basis_to_condition(feature_set.basis_feature_number(),-1);
+    for(auto basis_idx : plan.basis) {
+        int & condition_idx = basis_to_condition[basis_idx];
+        if(condition_idx<0) {
+            condition_idx = conditions.size();
+            const auto & basis_feature = feature_set.basis_feature(basis_idx);
+            Condition condition = {std::get<0>(basis_feature),
+                                   std::get<1>(basis_feature),
+                                   std::get<2>(basis_feature)};
+            conditions.push_back(condition);
+            history_n = std::max(history_n,-condition.time);
+        }
+        feature_conditions.push_back(condition_idx);
+    }
+    condition_ptr = plan.basis_ptr;
+    outcome_ptr = plan.outcome_ptr;
+    feature_outcomes = plan.outcomes;
+    weights = feature_set.weights();
+    // allocate buffers
+    condition_values.assign(conditions.size(),false);
+    distribution.assign(model.outcome_number(),0);
+    DEBUG_OUT(2,weights.size() << " features, " << conditions.size() << " conditions, "
+              << distribution.size() << " outcomes");
+}
+
+const vector<double> & Predictor::predict(const data_t & data, int data_idx) {
+    DEBUG_EXPECT(data_idx>=0 && data_idx<(int)data.size());
+    for(int condition_idx=0; condition_idx<(int)conditions.size(); ++condition_idx) {
+        const auto & condition = conditions[condition_idx];
+        int idx = data_idx+condition.time;
+        bool is_true = false;
+        if(idx>=0) {
+            switch(condition.type) {
+            case TemporallyExtendedModel::ACTION:
+                is_true = data[idx].action==condition.value;
+                break;
+            case TemporallyExtendedModel::OBSERVATION:
+                is_true = data[idx].observation==condition.value;
+                break;
+            case TemporallyExtendedModel::REWARD:
+                is_true = data[idx].reward==condition.value;
+                break;
+            }
+        }
+        condition_values[condition_idx] = is_true;
+    }
+    return evaluate();
+}
+
+double Predictor::probability(const data_t & data, int data_idx) {
+    int outcome_idx = outcome_index(data[data_idx]);
+    if(outcome_idx<0) return 0;
+    return predict(data,data_idx)[outcome_idx];
+}
+
+int Predictor::outcome_index(const DataPoint & point) const {
+    for(int outcome_idx=0; outcome_idx<(int)outcome_observations.size(); ++outcome_idx) {
+        if(outcome_observations[outcome_idx]==point.observation &&
+           outcome_rewards[outcome_idx]==point.reward) {
+            return outcome_idx;
+        }
+    }
+    return outcome_slot ? outcome_observations.size() : -1;
+}
+
+const vector<double> & Predictor::evaluate() {
+    // linear combinations for all outcomes
+    std::fill(distribution.begin(),distribution.end(),0);
+    for(int feature_idx=0; feature_idx<(int)weights.size(); ++feature_idx) {
+        bool is_true = true;
+        for(auto ptr=condition_ptr[feature_idx]; is_true && ptr<condition_ptr[feature_idx+1]; ++ptr) {
+            is_true = condition_values[feature_conditions[ptr]];
+        }
+        if(!is_true) continue;
+        const double weight = weights[feature_idx];
+        for(auto ptr=outcome_ptr[feature_idx]; ptr<outcome_ptr[feature_idx+1]; ++ptr) {
+            distribution[feature_outcomes[ptr]] += weight;
+        }
+    }
+    // normalize
+    TemporallyExtendedModel::softmax(distribution.data(),distribution.size());
+    return distribution;
+}
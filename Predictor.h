@@ -0,0 +1,99 @@
+#ifndef PREDICTOR_H_
+#define PREDICTOR_H_
+
+#include <vector>
+
+#include "TemporallyExtendedModel.h"
+
+/**
+ * Compiled TemporallyExtendedModel for fast repeated predictions.
+ *
+ * On construction the weights of the model are frozen into a contiguous
+ * vector and every feature is compiled into the conditions it places on the
+ * history (deduplicated over all features) and the outcomes it is compatible
+ * with (see TemporallyExtendedModel::FeaturePlan). A prediction evaluates each
+ * condition once, accumulates the weights of the active features for their
+ * outcomes, and normalizes with TemporallyExtendedModel::softmax().
+ * All buffers are allocated on construction so predict() does not allocate.
+ *
+ * Predictions are made for the outcome (observation and reward) of a given
+ * data point, with the action of that data point and all earlier data points
+ * as history. The outcomes are those seen in the training data (see
+ * outcome_observation() and outcome_reward()), possibly followed by an outcome
+ * slot for all other outcomes. Since predictions use internal
+ * buffers every thread needs its own copy of a predictor.
+ */
+class Predictor {
+
+    //----typdefs/classes----//
+public:
+    typedef TemporallyExtendedModel::action_t action_t;
+    typedef TemporallyExtendedModel::observation_t observation_t;
+    typedef TemporallyExtendedModel::reward_t reward_t;
+    typedef TemporallyExtendedModel::DataPoint DataPoint;
+    typedef TemporallyExtendedModel::data_t data_t;
+    typedef TemporallyExtendedModel::FEATURE_TYPE FEATURE_TYPE;
+    /** A basis feature referring to the history. */
+    struct Condition {
+        FEATURE_TYPE type;
+        int time;
+        double value;
+    };
+
+    //----members----//
+protected:
+    std::vector<Condition> conditions;          ///< Conditions on the history
+    std::vector<std::size_t> condition_ptr;     ///< Conditions of feature i in
+                                                ///[condition_ptr[i],condition_ptr[i+1])
+                                                ///of feature_conditions
+    std::vector<int> feature_conditions;        ///< Condition indices
+    std::vector<std::size_t> outcome_ptr;       ///< Outcomes of feature i in
+                                                ///[outcome_ptr[i],outcome_ptr[i+1])
+                                                ///of feature_outcomes
+    std::vector<int> feature_outcomes;          ///< Outcome indices
+    std::vector<double> weights;                ///< Feature weights
+    std::vector<observation_t> outcome_observations; ///< Observation of each
+                                                     ///outcome
+    std::vector<reward_t> outcome_rewards;      ///< Reward of each outcome
+    bool outcome_slot = false;                  ///< Whether the last outcome
+                                                ///stands for all unseen
+                                                ///outcomes
+    int history_n = 0;                          ///< Maximum number of past
+                                                ///data points any condition
+                                                ///refers to
+    // buffers
+    std::vector<char> condition_values;         ///< Truth values of conditions
+    std::vector<double> distribution;           ///< Predictive distribution
+
+    //----methods----//
+public:
+    Predictor(const TemporallyExtendedModel & model);
+    virtual ~Predictor() = default;
+    /**
+     * Predictive distribution over outcomes for the given data point (the
+     * returned reference remains valid until the next prediction). */
+    const std::vector<double> & predict(const data_t & data, int data_idx);
+    /** Predictive distribution over outcomes for the last data point. */
+    const std::vector<double> & predict(const data_t & data) {return predict(data,data.size()-1);}
+    /**
+     * Predictive probability of the actual outcome of the given data point
+     * (zero if the outcome did not occur in the training data, unless there
+     * is an outcome slot). */
+    double probability(const data_t & data, int data_idx);
+    /**
+     * Index of the outcome of given data point (the outcome slot or -1 if
+     * unknown). */
+    int outcome_index(const DataPoint & point) const;
+    int outcome_number() const {return distribution.size();}
+    bool has_outcome_slot() const {return outcome_slot;}
+    observation_t outcome_observation(int outcome_idx) const {return outcome_observations[outcome_idx];}
+    reward_t outcome_reward(int outcome_idx) const {return outcome_rewards[outcome_idx];}
+    int feature_number() const {return weights.size();}
+    /** Maximum number of past data points predictions depend on. */
+    int history_length() const {return history_n;}
+protected:
+    /** Compute distribution from the current condition_values. */
+    const std::vector<double> & evaluate();
+};
+
+#endif /* PREDICTOR_H_ */
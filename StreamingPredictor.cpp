@@ -0,0 +1,96 @@
+#include "StreamingPredictor.h"
+
+#include <algorithm>
+
+#define DEBUG_STRING "StreamingPredictor: "
+#define DEBUG_LEVEL 0
+#include "debug.h"
+
+using std::vector;
+
+// index of lookup table for given time offset and type
+static int lookup_index(int time, int type) {
+    return -time*3+type;
+}
+
+StreamingPredictor::StreamingPredictor(const TemporallyExtendedModel & model):
+    Predictor(model),
+    history(history_n,DataPoint(0,0,0))
+{
+    // index conditions
+    lookup.resize(3*(history_n+1));
+    for(int condition_idx=0; condition_idx<(int)conditions.size(); ++condition_idx) {
+        const auto & condition = conditions[condition_idx];
+        lookup[lookup_index(condition.time,condition.type)].push_back(std::make_pair(condition.value,condition_idx));
+    }
+    for(auto & values : lookup) {
+        std::sort(values.begin(),values.end());
+    }
+    // at most one condition per time offset and type can be true
+    true_history_conditions.reserve(3*history_n);
+    true_action_conditions.reserve(1);
+}
+
+void StreamingPredictor::add(const DataPoint & point) {
+    if(history_n==0) return;
+    newest = (newest+1)%history_n;
+    history[newest] = point;
+    history_size = std::min(history_size+1,history_n);
+    // switch off conditions that were true
+    for(auto condition_idx : true_history_conditions) {
+        condition_values[condition_idx] = false;
+    }
+    true_history_conditions.clear();
+    // switch on conditions that are true now
+    for(int lag=1; lag<=history_size; ++lag) {
+        const auto & past = history[(newest-lag+1+history_n)%history_n];
+        int condition_idx;
+        if((condition_idx=find_condition(-lag,TemporallyExtendedModel::ACTION,past.action))>=0) {
+            true_history_conditions.push_back(condition_idx);
+        }
+        if((condition_idx=find_condition(-lag,TemporallyExtendedModel::OBSERVATION,past.observation))>=0) {
+            true_history_conditions.push_back(condition_idx);
+        }
+        if((condition_idx=find_condition(-lag,TemporallyExtendedModel::REWARD,past.reward))>=0) {
+            true_history_conditions.push_back(condition_idx);
+        }
+    }
+    for(auto condition_idx : true_history_conditions) {
+        condition_values[condition_idx] = true;
+    }
+}
+
+void StreamingPredictor::clear() {
+    newest = -1;
+    history_size = 0;
+    for(auto condition_idx : true_history_conditions) {
+        condition_values[condition_idx] = false;
+    }
+    true_history_conditions.clear();
+}
+
+const vector<double> & StreamingPredictor::predict(action_t action) {
+    for(auto condition_idx : true_action_conditions) {
+        condition_values[condition_idx] = false;
+    }
+    true_action_conditions.clear();
+    int condition_idx = find_condition(0,TemporallyExtendedModel::ACTION,action);
+    if(condition_idx>=0) {
+        condition_values[condition_idx] = true;
+        true_action_conditions.push_back(condition_idx);
+    }
+    return evaluate();
+}
+
+double StreamingPredictor::probability(const DataPoint & point) {
+    int outcome_idx = outcome_index(point);
+    if(outcome_idx<0) return 0;
+    return predict(point.action)[outcome_idx];
+}
+
+int StreamingPredictor::find_condition(int time, FEATURE_TYPE type, double value) const {
+    const auto & values = lookup[lookup_index(time,type)];
+    auto it = std::lower_bound(values.begin(),values.end(),std::make_pair(value,-1));
+    if(it!=values.end() && it->first==value) return it->second;
+    return -1;
+}
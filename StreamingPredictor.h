@@ -0,0 +1,82 @@
+#ifndef STREAMING_PREDICTOR_H_
+#define STREAMING_PREDICTOR_H_
+
+#include <vector>
+#include <utility>
+
+#include "Predictor.h"
+
+/**
+ * Stateful Predictor that is fed with one data point at a time.
+ *
+ * Only the last history_length() data points are kept in a ring buffer.
+ * Conditions are indexed by time offset, type, and value so that on every new
+ * data point the conditions that become true can be looked up directly
+ * (instead of evaluating all conditions), and only these are switched on while
+ * the previously true ones are switched off. The cost of add() and predict()
+ * is therefore independent of the length of the history and add() does not
+ * allocate.
+ *
+ * The Predictor is inherited protectedly because its predict() and
+ * probability() for a complete history would overwrite the condition values
+ * maintained by add(). Only the methods that do not depend on the history are
+ * made public again.
+ */
+class StreamingPredictor: protected Predictor {
+
+    //----typdefs/classes----//
+public:
+    using Predictor::action_t;
+    using Predictor::observation_t;
+    using Predictor::reward_t;
+    using Predictor::DataPoint;
+    using Predictor::data_t;
+
+    //----members----//
+protected:
+    std::vector<DataPoint> history;             ///< Ring buffer of past data
+                                                ///points
+    int newest = -1;                            ///< Position of newest data
+                                                ///point in history
+    int history_size = 0;                       ///< Number of valid data points
+                                                ///in history
+    std::vector<std::vector<std::pair<double,int>>> lookup; ///< Conditions
+                                                ///(value and index) for each
+                                                ///time offset and type
+                                                ///(sorted by value)
+    std::vector<int> true_history_conditions;   ///< Conditions on past data
+                                                ///points that are true
+    std::vector<int> true_action_conditions;    ///< Conditions on the current
+                                                ///action that are true
+
+    //----methods----//
+public:
+    StreamingPredictor(const TemporallyExtendedModel & model);
+    virtual ~StreamingPredictor() = default;
+    /** Append a data point (action, observation, reward) to the history. */
+    void add(const DataPoint & point);
+    /** Forget the history (e.g. at the beginning of an episode). */
+    void clear();
+    /**
+     * Predictive distribution over outcomes (next observation and reward)
+     * when taking the given action (the returned reference remains valid
+     * until the next prediction). */
+    const std::vector<double> & predict(action_t action);
+    /**
+     * Predictive probability of the outcome of the given data point when
+     * taking its action (zero if the outcome did not occur in the training
+     * data). The data point is not added to the history. */
+    double probability(const DataPoint & point);
+    using Predictor::outcome_index;
+    using Predictor::outcome_number;
+    using Predictor::has_outcome_slot;
+    using Predictor::outcome_observation;
+    using Predictor::outcome_reward;
+    using Predictor::feature_number;
+    using Predictor::history_length;
+protected:
+    /** Index of the condition with given time, type, and value (or -1). */
+    int find_condition(int time, FEATURE_TYPE type, double value) const;
+};
+
+#endif /* STREAMING_PREDICTOR_H_ */
@@ -1,8 +1,20 @@
 #include "TemporallyExtendedModel.h"
 
 #include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <random>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "lbfgs_codes.h"
+#include "TrajectoryFile.h"
 
 #include <omp.h>
 #define USE_OMP
@@ -47,8 +59,156 @@ std::ostream& operator<<(std::ostream & out,
     return out;
 }
 
+// number of contiguous chunks parallel loops are split into (one per thread)
+static int chunk_number() {
+    #ifdef USE_OMP
+    return omp_get_max_threads();
+    #else
+    return 1;
+    #endif
+}
+
+// first index of the chunk_idx-th of chunk_n contiguous chunks of [0,n)
+static int chunk_begin(int n, int chunk_idx, int chunk_n) {
+    return ((long)n*chunk_idx)/chunk_n;
+}
+
+double TemporallyExtendedModel::softmax(double * lin, int n) {
+    if(n==0) return -std::numeric_limits<double>::infinity();
+    double max_lin = *std::max_element(lin,lin+n);
+    double z = 0;
+    #ifdef USE_OMP
+    #pragma omp simd reduction(+:z)
+    #endif
+    for(int idx=0; idx<n; ++idx) {
+        lin[idx] = exp(lin[idx]-max_lin);
+        z += lin[idx];
+    }
+    const double z_inv = 1/z;
+    #ifdef USE_OMP
+    #pragma omp simd
+    #endif
+    for(int idx=0; idx<n; ++idx) {
+        lin[idx] *= z_inv;
+    }
+    return max_lin+log(z);
+}
+
+// check whether w lies on the line through w_0 and w_1 (up to rounding) and
+// if so compute t such that w = w_0+t*(w_1-w_0)
+static bool on_line(const vector<double> & w_0,
+                    const vector<double> & w_1,
+                    const double * w,
+                    int n,
+                    double & t) {
+    if((int)w_0.size()!=n || (int)w_1.size()!=n) return false;
+    // get t from the largest difference
+    int max_idx = -1;
+    double max_diff = 0;
+    for(int idx=0; idx<n; ++idx) {
+        double diff = fabs(w_1[idx]-w_0[idx]);
+        if(diff>max_diff) {
+            max_diff = diff;
+            max_idx = idx;
+        }
+    }
+    if(max_idx<0) return false;
+    t = (w[max_idx]-w_0[max_idx])/(w_1[max_idx]-w_0[max_idx]);
+    // verify all components
+    const double tolerance = 1e-12;
+    for(int idx=0; idx<n; ++idx) {
+        double w_t = w_0[idx]+t*(w_1[idx]-w_0[idx]);
+        if(fabs(w[idx]-w_t)>tolerance*(fabs(w_0[idx])+fabs(w_1[idx])+fabs(w[idx]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// all combinations of observations and rewards (in ascending order)
+static void outcome_product(const std::set<TemporallyExtendedModel::observation_t> & observations,
+                            const std::set<TemporallyExtendedModel::reward_t> & rewards,
+                            vector<TemporallyExtendedModel::observation_t> & outcome_observations,
+                            vector<TemporallyExtendedModel::reward_t> & outcome_rewards) {
+    outcome_observations.clear();
+    outcome_rewards.clear();
+    for(auto & observation : observations) {
+        for(auto & reward : rewards) {
+            outcome_observations.push_back(observation);
+            outcome_rewards.push_back(reward);
+        }
+    }
+}
+
+// concatenate episodes and record where they begin
+static void concatenate(const vector<TemporallyExtendedModel::data_t> & episodes,
+                        TemporallyExtendedModel::data_t & data,
+                        vector<int> & episode_begins) {
+    data.clear();
+    episode_begins.clear();
+    for(auto & episode : episodes) {
+        episode_begins.push_back(data.size());
+        data.insert(data.end(),episode.begin(),episode.end());
+    }
+}
+
+// binary model files start with the magic string and the format version
+// followed by the model in sections of (length, array) (see save())
+static const char model_magic[8] = {'A','T','E','M','M','O','D','L'};
+static const std::uint32_t model_version = 2;
+
+// write n values to a file
+template<class T>
+static bool write_array(FILE * file, const T * values, std::size_t n) {
+    return fwrite(values,sizeof(T),n,file)==n;
+}
+
+// write a vector with preceding length
+template<class T>
+static bool write_vector(FILE * file, const vector<T> & values) {
+    std::uint64_t n = values.size();
+    return write_array(file,&n,1) && write_array(file,values.data(),n);
+}
+
+// read from a memory-mapped file (with bounds checking)
+namespace {
+class MappedReader {
+public:
+    MappedReader(const char * begin, std::size_t length): ptr(begin), end(begin+length) {}
+    template<class T>
+    bool read_array(T * values, std::size_t n) {
+        if(n>(std::size_t)(end-ptr)/sizeof(T)) return false;
+        std::memcpy(values,ptr,n*sizeof(T));
+        ptr += n*sizeof(T);
+        return true;
+    }
+    template<class T>
+    bool read_vector(vector<T> & values) {
+        std::uint64_t n;
+        if(!read_array(&n,1) || n>(std::size_t)(end-ptr)/sizeof(T)) return false;
+        values.resize(n);
+        return read_array(values.data(),n);
+    }
+    bool at_end() const {return ptr==end;}
+private:
+    const char * ptr;
+    const char * end;
+};
+}
+
+// number of contexts processed together in neg_log_likelihood()
+static const int context_block_size = 256;
+
+// minimum average number of data points per context for packing the
+// F-matrices of all contexts into a separate store (see update_contexts())
+static const int context_packing_ratio = 2;
+
 // member function definitions
 
+const TemporallyExtendedModel::FEATURE_TYPE TemporallyExtendedModel::ACTION;
+const TemporallyExtendedModel::FEATURE_TYPE TemporallyExtendedModel::OBSERVATION;
+const TemporallyExtendedModel::FEATURE_TYPE TemporallyExtendedModel::REWARD;
+
 TemporallyExtendedModel::DataPoint::DataPoint(action_t action,
                                               observation_t observation,
                                               reward_t reward):
@@ -70,15 +230,63 @@ bool TemporallyExtendedModel::DataPoint::operator<(const DataPoint & other) cons
 TemporallyExtendedModel & TemporallyExtendedModel::set_data(const data_t & data_) {
     DEBUG_OUT(1,"Set data");
     DEBUG_INDENT;
-    data = data_;
-    // update unique values
+    auto points = std::make_shared<const data_t>(data_);
+    data = DataView(*points,points);
+    episode_begins.assign(1,0);
+    update_data();
+    return *this;
+}
+
+TemporallyExtendedModel & TemporallyExtendedModel::set_data(const vector<data_t> & episodes) {
+    DEBUG_OUT(1,"Set data (" << episodes.size() << " episodes)");
+    DEBUG_INDENT;
+    auto points = std::make_shared<data_t>();
+    concatenate(episodes,*points,episode_begins);
+    data = DataView(*points,points);
+    update_data();
+    return *this;
+}
+
+TemporallyExtendedModel & TemporallyExtendedModel::set_data(const TrajectoryFile & file) {
+    DEBUG_OUT(1,"Set data from trajectory file");
+    DEBUG_INDENT;
+    // read the columns in place (sharing the mapping)
+    data = file.view();
+    episode_begins.clear();
+    for(std::size_t episode_idx=0; episode_idx<file.episode_number(); ++episode_idx) {
+        episode_begins.push_back(file.episode_begin(episode_idx));
+    }
+    if(episode_begins.empty()) episode_begins.push_back(0);
+    update_data();
+    return *this;
+}
+
+void TemporallyExtendedModel::update_data() {
+    // update unique values (each chunk of data points collects its own and
+    // they are merged afterwards)
+    int data_n = data.size();
+    int chunk_n = chunk_number();
+    vector<std::set<int>> chunk_actions(chunk_n), chunk_observations(chunk_n);
+    vector<std::set<double>> chunk_rewards(chunk_n);
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static,1) collapse(1)
+    #endif
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        int end = chunk_begin(data_n,chunk_idx+1,chunk_n);
+        for(int data_idx=chunk_begin(data_n,chunk_idx,chunk_n); data_idx<end; ++data_idx) {
+            const auto & point = data[data_idx];
+            chunk_actions[chunk_idx].insert(point.action);
+            chunk_observations[chunk_idx].insert(point.observation);
+            chunk_rewards[chunk_idx].insert(point.reward);
+        }
+    }
     unique_actions.clear();
     unique_observations.clear();
     unique_rewards.clear();
-    for(auto & point : data) {
-        unique_actions.insert(point.action);
-        unique_observations.insert(point.observation);
-        unique_rewards.insert(point.reward);
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        unique_actions.insert(chunk_actions[chunk_idx].begin(),chunk_actions[chunk_idx].end());
+        unique_observations.insert(chunk_observations[chunk_idx].begin(),chunk_observations[chunk_idx].end());
+        unique_rewards.insert(chunk_rewards[chunk_idx].begin(),chunk_rewards[chunk_idx].end());
     }
     // debug output
     IF_DEBUG(3) {
@@ -104,11 +312,57 @@ TemporallyExtendedModel & TemporallyExtendedModel::set_data(const data_t & data_
             }
         }
     }
-    // resize outcome indices
-    outcome_indices.assign(data.size(),-1);
+    // F-matrices and predictions of the current model are outdated
+    basis_truth.reset(data.size());
+    update_outcomes();
+}
+
+TemporallyExtendedModel & TemporallyExtendedModel::set_observed_outcomes(bool observed, bool slot) {
+    observed_outcomes = observed;
+    outcome_slot = slot;
+    if(!data.empty()) update_outcomes();
     return *this;
 }
 
+void TemporallyExtendedModel::update_outcomes() {
+    outcome_observations.clear();
+    outcome_rewards.clear();
+    if(observed_outcomes) {
+        // collect pairs in parallel
+        int data_n = data.size();
+        int chunk_n = chunk_number();
+        vector<std::set<std::pair<observation_t,reward_t>>> chunk_outcomes(chunk_n);
+        #ifdef USE_OMP
+        #pragma omp parallel for schedule(static,1) collapse(1)
+        #endif
+        for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+            int end = chunk_begin(data_n,chunk_idx+1,chunk_n);
+            for(int data_idx=chunk_begin(data_n,chunk_idx,chunk_n); data_idx<end; ++data_idx) {
+                chunk_outcomes[chunk_idx].insert(std::make_pair(data[data_idx].observation,
+                                                                data[data_idx].reward));
+            }
+        }
+        std::set<std::pair<observation_t,reward_t>> outcomes;
+        for(auto & chunk : chunk_outcomes) {
+            outcomes.insert(chunk.begin(),chunk.end());
+        }
+        for(auto & outcome : outcomes) {
+            outcome_observations.push_back(outcome.first);
+            outcome_rewards.push_back(outcome.second);
+        }
+    } else {
+        outcome_product(unique_observations,unique_rewards,outcome_observations,outcome_rewards);
+    }
+    DEBUG_OUT(3,outcome_number() << " outcomes (" << unique_observations.size() << " observations, "
+              << unique_rewards.size() << " rewards" << (outcome_slot?", slot":"") << ")");
+    // everything referring to outcomes is outdated
+    outcome_indices.assign(data.size(),-1);
+    F_matrices.reset(0,0);
+    F_matrix_feature_ids.clear();
+    outcome_probabilities.reset();
+    optimum_feature_ids.clear();
+}
+
 double TemporallyExtendedModel::optimize() {
     DEBUG_OUT(1,"PULSE optimization");
     DEBUG_INDENT;
@@ -140,50 +394,196 @@ double TemporallyExtendedModel::optimize() {
     return likelihood;
 }
 
+std::vector<double> TemporallyExtendedModel::optimize_path(const std::vector<double> & regularizations,
+                                                           std::function<void(const TemporallyExtendedModel &)> callback) {
+    DEBUG_OUT(1,"Regularization path with " << regularizations.size() << " points");
+    DEBUG_INDENT;
+    int point_n = regularizations.size();
+    vector<double> likelihoods(point_n);
+    if(point_n==0) return likelihoods;
+    vector<int> order(point_n);
+    std::iota(order.begin(),order.end(),0);
+    std::stable_sort(order.begin(),order.end(),[&](int i, int j){
+            return regularizations[i]>regularizations[j];
+        });
+    // learn the feature set once for the weakest regularization
+    DEBUG_OUT(2,"Feature set for regularization " << regularizations[order.back()]);
+    set_regularization(regularizations[order.back()]);
+    optimize();
+    // re-optimize only the weights from strong to weak so that they carry
+    // over (features are not shrunk so that those with zero weight for
+    // strong regularizations are available for weaker ones)
+    for(auto point_idx : order) {
+        DEBUG_OUT(2,"Regularization " << regularizations[point_idx]);
+        set_regularization(regularizations[point_idx]);
+        likelihoods[point_idx] = optimize_weights();
+        if(callback) callback(*this);
+    }
+    return likelihoods;
+}
+
 double TemporallyExtendedModel::get_prediction(const data_t & pred_data) const {
     DEBUG_OUT(5,"Computing prediction");
     DEBUG_EXPECT(pred_data.size()>0);
-    // temporally add the given observation and reward to the unique sets in
-    // case they did not occur in the training data
-    auto unique_observations_copy = unique_observations;
-    auto unique_rewards_copy = unique_rewards;
-    unique_observations_copy.insert(pred_data.back().observation);
-    unique_rewards_copy.insert(pred_data.back().reward);
+    // temporally add the given observation and reward to the outcomes in
+    // case they did not occur in the training data (and there is no outcome
+    // slot for them)
+    auto outcome_observations_copy = outcome_observations;
+    auto outcome_rewards_copy = outcome_rewards;
+    if(outcome_index(pred_data.back())<0) {
+        if(observed_outcomes) {
+            outcome_observations_copy.push_back(pred_data.back().observation);
+            outcome_rewards_copy.push_back(pred_data.back().reward);
+        } else {
+            auto unique_observations_copy = unique_observations;
+            auto unique_rewards_copy = unique_rewards;
+            unique_observations_copy.insert(pred_data.back().observation);
+            unique_rewards_copy.insert(pred_data.back().reward);
+            outcome_product(unique_observations_copy,unique_rewards_copy,
+                            outcome_observations_copy,outcome_rewards_copy);
+        }
+    }
     // comput F-matrix
-    mat_t F = zeros<mat_t>(feature_set.size(),
-                           unique_observations_copy.size()*unique_rewards_copy.size());
+    FMatrixStore F(feature_set.size(),
+                   outcome_observations_copy.size()+(outcome_slot?1:0));
     int outcome_idx;
+    vector<int> features(feature_set.size());
+    std::iota(features.begin(),features.end(),0);
     fill_F_matrix(feature_set,
-                  unique_actions,
-                  unique_observations_copy,
-                  unique_rewards_copy,
+                  features,
+                  outcome_observations_copy,
+                  outcome_rewards_copy,
+                  outcome_slot,
                   pred_data,
                   pred_data.size()-1,
                   F,
                   outcome_idx);
     DEBUG_EXPECT(outcome_idx>=0);
-    // get weights
-    col_vec_t w;
-    {
-        w.zeros(feature_set.size());
-        int feature_idx = 0;
-        for(auto & feature : feature_set) {
-            w(feature_idx) = feature.second;
-            ++feature_idx;
+    // interim variables
+    row_vec_t p(F.n_cols());
+    F[0].transposed_product(feature_set.weights().data(),p.memptr());
+    softmax(p.memptr(),p.n_elem);
+    return p(outcome_idx);
+}
+
+TemporallyExtendedModel::mat_t TemporallyExtendedModel::get_predictions(const data_t & pred_data) const {
+    mat_t distributions(outcome_number(),pred_data.size());
+    batch_predict(pred_data,vector<int>(1,0),distributions.memptr(),nullptr);
+    return distributions;
+}
+
+TemporallyExtendedModel::mat_t TemporallyExtendedModel::get_predictions(const vector<data_t> & episodes) const {
+    data_t pred_data;
+    vector<int> pred_episode_begins;
+    concatenate(episodes,pred_data,pred_episode_begins);
+    mat_t distributions(outcome_number(),pred_data.size());
+    batch_predict(pred_data,pred_episode_begins,distributions.memptr(),nullptr);
+    return distributions;
+}
+
+TemporallyExtendedModel::col_vec_t TemporallyExtendedModel::get_log_likelihoods(const data_t & pred_data) const {
+    col_vec_t log_likelihoods(pred_data.size());
+    batch_predict(pred_data,vector<int>(1,0),nullptr,log_likelihoods.memptr());
+    return log_likelihoods;
+}
+
+TemporallyExtendedModel::col_vec_t TemporallyExtendedModel::get_log_likelihoods(const vector<data_t> & episodes) const {
+    data_t pred_data;
+    vector<int> pred_episode_begins;
+    concatenate(episodes,pred_data,pred_episode_begins);
+    col_vec_t log_likelihoods(pred_data.size());
+    batch_predict(pred_data,pred_episode_begins,nullptr,log_likelihoods.memptr());
+    return log_likelihoods;
+}
+
+void TemporallyExtendedModel::batch_predict(const data_t & pred_data,
+                                            const vector<int> & pred_episode_begins,
+                                            double * distributions,
+                                            double * log_likelihoods) const {
+    DEBUG_OUT(3,"Computing predictions for " << pred_data.size() << " data points");
+    DEBUG_INDENT;
+    int data_n = pred_data.size();
+    int feature_n = feature_set.size();
+    int outcome_n = outcome_number();
+    if(data_n==0 || outcome_n==0) return;
+    // plan all features and evaluate the basis features they depend on for
+    // the given data (with plan.basis referring to compact columns)
+    vector<int> features(feature_n);
+    std::iota(features.begin(),features.end(),0);
+    FeaturePlan plan;
+    plan_features(features,plan);
+    vector<int> basis_to_col(feature_set.basis_feature_number(),-1), col_to_basis;
+    for(auto & basis_idx : plan.basis) {
+        int & col = basis_to_col[basis_idx];
+        if(col<0) {
+            col = col_to_basis.size();
+            col_to_basis.push_back(basis_idx);
         }
+        basis_idx = col;
     }
-    // interim variables
-    const row_vec_t lin = w.t()*F;
-    const row_vec_t exp_lin = arma::exp(lin);
-    const double z = arma::sum(exp_lin);
-    return exp_lin(outcome_idx)/z;
+    TruthTable truth;
+    truth.reset(data_n);
+    for(int col=0; col<(int)col_to_basis.size(); ++col) {
+        truth.add_column();
+    }
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(dynamic,1) collapse(1)
+    #endif
+    for(int col=0; col<(int)col_to_basis.size(); ++col) {
+        evaluate_basis_feature(col_to_basis[col],pred_data,pred_episode_begins,truth,col);
+    }
+    // compute F-matrices for 64 data points at a time and evaluate them right
+    // away (chunks of words in parallel)
+    const double * w = feature_set.weights().data();
+    int word_n = truth.word_number();
+    int chunk_n = chunk_number();
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static,1) collapse(1)
+    #endif
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        FMatrixStore F(feature_n,outcome_n);
+        FillBuffers buffers;
+        vector<double> buffer(outcome_n);
+        int end = chunk_begin(word_n,chunk_idx+1,chunk_n);
+        for(int word_idx=chunk_begin(word_n,chunk_idx,chunk_n); word_idx<end; ++word_idx) {
+            F.reset(feature_n,outcome_n);
+            fill_F_matrices(plan,truth,word_idx,F,buffers);
+            for(int bit_idx=0; bit_idx<F.size(); ++bit_idx) {
+                int data_idx = word_idx*TruthTable::word_bits+bit_idx;
+                double * p = distributions!=nullptr ?
+                    distributions+(std::size_t)data_idx*outcome_n :
+                    buffer.data();
+                F[bit_idx].transposed_product(w,p);
+                int outcome_idx = log_likelihoods!=nullptr ? outcome_index(pred_data[data_idx]) : -1;
+                double outcome_lin = outcome_idx>=0 ? p[outcome_idx] : 0;
+                double log_z = softmax(p,outcome_n);
+                if(log_likelihoods!=nullptr) {
+                    log_likelihoods[data_idx] = outcome_idx>=0 ?
+                        outcome_lin-log_z :
+                        -std::numeric_limits<double>::infinity();
+                }
+            }
+        }
+    } // end parallel
 }
 
 double TemporallyExtendedModel::optimize_weights() {
+    if(optimizer!=LBFGS) return optimize_weights_stochastic();
     DEBUG_OUT(3,"Optimizting weights");
     DEBUG_INDENT;
     // update F-matrices
     update_F_matrices();
+    // Warm start: weights of surviving features carry over and new features
+    // start at zero. If only features with zero weight were removed (or
+    // none were added) the weights are already optimal.
+    if(weights_at_optimum()) {
+        DEBUG_OUT(3,"Active features unchanged, skipping optimization");
+        if(outcome_probabilities.n_cols!=data.size()) {
+            update_outcome_probabilities();
+        }
+        DEBUG_OUT(3,"likelihood = " << exp(-optimum_objective));
+        return exp(-optimum_objective);
+    }
     // optimize weights
     lbfgsfloatval_t objective_value;
     {
@@ -203,13 +603,7 @@ double TemporallyExtendedModel::optimize_weights() {
         // initialize variables
         lbfgsfloatval_t * weights = lbfgs_malloc(feature_set.size());
         // set weights
-        {
-            int feature_idx = 0;
-            for(auto & feature : feature_set) {
-                weights[feature_idx] = feature.second;
-                ++feature_idx;
-            }
-        }
+        std::copy(feature_set.weights().begin(),feature_set.weights().end(),weights);
         // start the L-BFGS optimization
         auto ret = lbfgs(feature_set.size(),
                          weights,
@@ -221,28 +615,205 @@ double TemporallyExtendedModel::optimize_weights() {
         IF_DEBUG(2) {cout << endl;}
         DEBUG_OUT(2,"status code = " << ret << " ( " << lbfgs_code(ret) << " )");
         // get weights
-        {
-            int feature_idx = 0;
-            for(auto & feature : feature_set) {
-                feature.second = weights[feature_idx];
-                ++feature_idx;
-            }
-        }
+        std::copy(weights,weights+feature_set.size(),feature_set.weights().begin());
         // free weights
         lbfgs_free(weights);
+        // remember converged optimum
+        optimum_feature_ids.clear();
+        optimum_weights.clear();
+        if(ret>=0) {
+            for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+                optimum_feature_ids.push_back(feature_set.id(feature_idx));
+                optimum_weights.push_back(feature_set.weight(feature_idx));
+            }
+            optimum_regularization = regularization;
+            optimum_objective = objective_value;
+        }
     }
+    // cache predictions for scoring candidate features
+    update_outcome_probabilities();
     // print likelihood
     DEBUG_OUT(3,"likelihood = " << exp(-objective_value));
     return exp(-objective_value);
 }
 
+bool TemporallyExtendedModel::weights_at_optimum() const {
+    if(optimum_feature_ids.empty() || regularization!=optimum_regularization) return false;
+    // feature ids are increasing so walk through both in parallel
+    int optimum_idx = 0, optimum_n = optimum_feature_ids.size();
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        auto id = feature_set.id(feature_idx);
+        for(; optimum_idx<optimum_n && optimum_feature_ids[optimum_idx]<id; ++optimum_idx) {
+            if(optimum_weights[optimum_idx]!=0) return false;
+        }
+        if(optimum_idx==optimum_n || optimum_feature_ids[optimum_idx]!=id ||
+           optimum_weights[optimum_idx]!=feature_set.weight(feature_idx)) {
+            return false;
+        }
+        ++optimum_idx;
+    }
+    for(; optimum_idx<optimum_n; ++optimum_idx) {
+        if(optimum_weights[optimum_idx]!=0) return false;
+    }
+    return true;
+}
+
+double TemporallyExtendedModel::optimize_weights_stochastic() {
+    DEBUG_OUT(3,"Optimizting weights (" << (optimizer==ADAM?"Adam":"SGD") << ")");
+    DEBUG_INDENT;
+    int feature_n = feature_set.size();
+    int data_n = data.size();
+    // outcome indices, basis features, and plan for all features
+    update_outcome_indices();
+    update_basis_truth();
+    vector<int> features(feature_n);
+    std::iota(features.begin(),features.end(),0);
+    FeaturePlan plan;
+    plan_features(features,plan);
+    // mini-batches consist of whole truth table words (drawn in a new random
+    // order in every epoch)
+    int word_n = basis_truth.word_number();
+    int batch_words = std::max((batch_size+TruthTable::word_bits-1)/TruthTable::word_bits,1);
+    vector<int> words(word_n), batch;
+    std::iota(words.begin(),words.end(),0);
+    std::mt19937 generator(0);
+    // Adam parameters and moment estimates
+    const double beta_1 = 0.9, beta_2 = 0.999, epsilon = 1e-8;
+    double beta_1_t = 1, beta_2_t = 1;
+    vector<double> gradient(feature_n), m(feature_n,0), v(feature_n,0);
+    auto & weights = feature_set.weights();
+    double last_objective = std::numeric_limits<double>::infinity();
+    // run epochs until the objective does not improve anymore or the maximum
+    // number of epochs is reached
+    for(int epoch=1;
+        max_inner_loop_iterations<=0 || epoch<=max_inner_loop_iterations;
+        ++epoch) {
+        std::shuffle(words.begin(),words.end(),generator);
+        double objective = 0;
+        for(int batch_begin=0; batch_begin<word_n; batch_begin+=batch_words) {
+            batch.assign(words.begin()+batch_begin,words.begin()+std::min(batch_begin+batch_words,word_n));
+            double batch_objective = streamed_neg_log_likelihood(plan,batch,weights.data(),gradient.data(),false);
+            // weight by the number of data points (the last word may be
+            // partial)
+            int batch_data_n = 0;
+            for(auto word_idx : batch) {
+                int word_begin = word_idx*TruthTable::word_bits;
+                batch_data_n += std::min(word_begin+TruthTable::word_bits,data_n)-word_begin;
+            }
+            objective += batch_objective*batch_data_n/data_n;
+            beta_1_t *= beta_1;
+            beta_2_t *= beta_2;
+            for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+                double step = learning_rate;
+                double direction = gradient[feature_idx];
+                if(optimizer==ADAM) {
+                    m[feature_idx] = beta_1*m[feature_idx]+(1-beta_1)*direction;
+                    v[feature_idx] = beta_2*v[feature_idx]+(1-beta_2)*direction*direction;
+                    direction = m[feature_idx]/(1-beta_1_t);
+                    step /= sqrt(v[feature_idx]/(1-beta_2_t))+epsilon;
+                }
+                // gradient step followed by the proximal step of the
+                // L1-regularization (soft thresholding)
+                double & w = weights[feature_idx];
+                w -= step*direction;
+                double shrink = step*regularization;
+                w = w>shrink ? w-shrink : (w<-shrink ? w+shrink : 0);
+            }
+        }
+        for(auto w : weights) objective += regularization*fabs(w);
+        IF_DEBUG(2) {
+            cout << "\rEpoch " << epoch
+                 << ", likelihood = " << exp(-objective) << "    " << std::flush;
+        }
+        if(max_inner_loop_iterations<=0 &&
+           (last_objective-objective)/fabs(objective)<=likelihood_threshold) {
+            break;
+        }
+        last_objective = objective;
+    }
+    IF_DEBUG(2) {cout << endl;}
+    // objective on all data for the final weights (caching predictions for
+    // scoring candidate features)
+    outcome_probabilities.set_size(outcome_number(),data_n);
+    double objective = streamed_neg_log_likelihood(plan,words,weights.data(),nullptr,true);
+    for(auto w : weights) objective += regularization*fabs(w);
+    DEBUG_OUT(3,"likelihood = " << exp(-objective));
+    return exp(-objective);
+}
+
+double TemporallyExtendedModel::streamed_neg_log_likelihood(const FeaturePlan & plan,
+                                                           const vector<int> & words,
+                                                           const double * weights,
+                                                           double * gradient,
+                                                           bool store_probabilities) {
+    int feature_n = plan.basis_ptr.size()-1;
+    int outcome_n = outcome_number();
+    int word_n = words.size();
+    // every chunk of words accumulates its own gradient, objective, and
+    // number of data points (as in neg_log_likelihood())
+    int chunk_n = chunk_number();
+    if(gradient!=nullptr) chunk_gradients.zeros(feature_n,chunk_n);
+    vector<double> chunk_objectives(chunk_n,0);
+    vector<int> chunk_data_n(chunk_n,0);
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static,1) collapse(1)
+    #endif
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        FMatrixStore F(feature_n,outcome_n);
+        FillBuffers buffers;
+        vector<double> p(outcome_n);
+        int end = chunk_begin(word_n,chunk_idx+1,chunk_n);
+        for(int idx=chunk_begin(word_n,chunk_idx,chunk_n); idx<end; ++idx) {
+            int word_idx = words[idx];
+            F.reset(feature_n,outcome_n);
+            fill_F_matrices(plan,basis_truth,word_idx,F,buffers);
+            for(int bit_idx=0; bit_idx<F.size(); ++bit_idx) {
+                int data_idx = word_idx*TruthTable::word_bits+bit_idx;
+                int outcome_idx = outcome_indices[data_idx];
+                DEBUG_EXPECT(outcome_idx>=0);
+                // predictive distribution (subtracting the maximum for
+                // numerical stability)
+                F[bit_idx].transposed_product(weights,p.data());
+                double outcome_lin = p[outcome_idx];
+                chunk_objectives[chunk_idx] += outcome_lin-softmax(p.data(),outcome_n);
+                if(store_probabilities) {
+                    std::copy(p.begin(),p.end(),outcome_probabilities.colptr(data_idx));
+                }
+                // gradient term is F*explin/z - F.col(outcome_idx)
+                if(gradient!=nullptr) {
+                    p[outcome_idx] -= 1;
+                    F[bit_idx].add_product(p.data(),chunk_gradients.colptr(chunk_idx));
+                }
+            }
+            chunk_data_n[chunk_idx] += F.size();
+        }
+    } // end parallel
+    // merge chunks and divide by number of data points
+    int data_n = 0;
+    double objective = 0;
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        data_n += chunk_data_n[chunk_idx];
+        objective -= chunk_objectives[chunk_idx];
+    }
+    if(data_n==0) data_n = 1;
+    if(gradient!=nullptr) {
+        for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+            double sum = 0;
+            for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+                sum += chunk_gradients(feature_idx,chunk_idx);
+            }
+            gradient[feature_idx] = sum/data_n;
+        }
+    }
+    return objective/data_n;
+}
+
 bool TemporallyExtendedModel::check_derivatives() {
     DEBUG_OUT(1,"Checking derivatives");
     DEBUG_INDENT;
     // initialize some vectors
-    vector<double> weights, weights_copy, gradient(feature_set.size()), diffs(feature_set.size());
-    for(auto & feature : feature_set) weights.push_back(feature.second);
-    weights_copy = weights;
+    vector<double> weights = feature_set.weights(), weights_copy = weights,
+        gradient(feature_set.size()), diffs(feature_set.size());
     // delta/epsilon
     double delta = 1e-5;
     double epsilon = 1e-5;
@@ -292,27 +863,43 @@ bool TemporallyExtendedModel::check_derivatives() {
 }
 
 void TemporallyExtendedModel::expand_feature_set() {
-    // first make a copy of the initial feature set which remains unchanged during expansion
-    auto initial_feature_set = feature_set;
+    // make sure predictions of the current model are available for scoring
+    // candidates
+    bool admission = candidate_threshold>=0 || max_candidates>0;
+    if(admission && admission_score==GRADIENT && outcome_probabilities.n_cols!=data.size()) {
+        update_F_matrices();
+        update_outcome_probabilities();
+    }
+    if(admission && admission_score==SUPPORT) {
+        update_outcome_indices();
+    }
+    // new features are appended so the initial features remain unchanged at
+    // the beginning
+    int initial_feature_n = feature_set.size();
     // initialize if feature set is empty expand otherwise
     if(feature_set.empty()) {
-        // add simple basis features
-        for(auto & action : unique_actions) {
-            feature_set[feature_t({basis_feature_t(ACTION,0,action)})] = 0;
-        }
+        // add simple basis features (actions alone do not depend on the
+        // outcome, see below)
         for(auto & observation : unique_observations) {
-            feature_set[feature_t({basis_feature_t(OBSERVATION,0,observation)})] = 0;
+            int basis_idx = feature_set.intern(basis_feature_t(OBSERVATION,0,observation));
+            feature_set.insert(&basis_idx,&basis_idx+1);
         }
         for(auto & reward : unique_rewards) {
-            feature_set[feature_t({basis_feature_t(REWARD,0,reward)})] = 0;
+            int basis_idx = feature_set.intern(basis_feature_t(REWARD,0,reward));
+            feature_set.insert(&basis_idx,&basis_idx+1);
+        }
+        // only admit the most promising candidates
+        if(admission) {
+            vector<double> admitted_scores;
+            admit_candidates(initial_feature_n,initial_feature_n,admitted_scores);
         }
     } else {
         // find maximum temporal extension
         int max_extension = 0;
-        for(auto & feature : initial_feature_set) {
-            for(auto & basis_feature : feature.first) {
+        for(int feature_idx=0; feature_idx<initial_feature_n; ++feature_idx) {
+            for(auto basis_idx : feature_set[feature_idx]) {
                 BASIS_FEATURE(tuple,type,time,value);
-                tuple = basis_feature;
+                tuple = feature_set.basis_feature(basis_idx);
                 max_extension = std::max(max_extension,time);
             }
         }
@@ -329,81 +916,162 @@ void TemporallyExtendedModel::expand_feature_set() {
             // we extend by specified amount
             max_extension -= horizon_extension;
         }
-        // go through all (initial) features, for all possible temporal delays
-        // augment with simple basis features, and add to set
-        for(auto & feature : initial_feature_set) {
-            for(int t_idx = 0; t_idx>=max_extension; --t_idx) {
-                for(auto & action : unique_actions) {
-                    feature_t f = feature.first;
-                    f.insert(basis_feature_t(ACTION,t_idx,action));
-                    feature_set[f] = 0;
-                }
-                for(auto & observation : unique_observations) {
-                    feature_t f = feature.first;
-                    f.insert(basis_feature_t(OBSERVATION,t_idx,observation));
-                    feature_set[f] = 0;
-                }
-                for(auto & reward : unique_rewards) {
-                    feature_t f = feature.first;
-                    f.insert(basis_feature_t(REWARD,t_idx,reward));
-                    feature_set[f] = 0;
-                }
+        // intern all simple basis features for all possible temporal delays
+        vector<int> candidate_basis;
+        for(int t_idx = 0; t_idx>=max_extension; --t_idx) {
+            for(auto & action : unique_actions) {
+                candidate_basis.push_back(feature_set.intern(basis_feature_t(ACTION,t_idx,action)));
+            }
+            for(auto & observation : unique_observations) {
+                candidate_basis.push_back(feature_set.intern(basis_feature_t(OBSERVATION,t_idx,observation)));
+            }
+            for(auto & reward : unique_rewards) {
+                candidate_basis.push_back(feature_set.intern(basis_feature_t(REWARD,t_idx,reward)));
             }
         }
-        // remove contradictory feature (same type, same time, different value)
-        for(auto feature_it = feature_set.begin();
-            feature_it!=feature_set.end();
-            /*increment manually*/) {
-            bool deleted = false;
-            for(auto basis_feature_it = feature_it->first.begin();
-                basis_feature_it!=feature_it->first.end();
-                ++basis_feature_it) {
-                // basis features are ordered first by type, second by time, and
-                // third by value so that contradictory feature will always be
-                // adjacent
-                auto next_basis_feature_it = basis_feature_it;
-                ++next_basis_feature_it;
-                if(next_basis_feature_it!=feature_it->first.end()) {
-                    BASIS_FEATURE(tuple_1, type_1, time_1, value_1);
-                    BASIS_FEATURE(tuple_2, type_2, time_2, value_2);
-                    tuple_1 = *basis_feature_it;
-                    tuple_2 = *next_basis_feature_it;
-                    if(type_1==type_2 && time_1==time_2 && value_1!=value_2) {
-                        // this feature contains contradictory basis features
-                        auto delete_feature_it = feature_it;
-                        ++feature_it;
-                        feature_set.erase(delete_feature_it);
-                        deleted = true;
-                        break;
+        // Go through all pairs of (initial) features and these basis features
+        // and augment the feature with the basis feature. Contiguous chunks
+        // of pairs are processed in parallel, each writing its candidates
+        // (without contradictory or existing features) into a flat
+        // thread-local buffer. The buffers are then inserted in order
+        // (removing duplicates) so the result does not depend on the number
+        // of threads. With an admission policy, candidates are generated for
+        // blocks of at most candidate_block_size pairs and admitted after
+        // each block (only scoring the new candidates and keeping the scores
+        // of those admitted before) so the number of candidates held at any
+        // time is bounded.
+        const long basis_n = candidate_basis.size();
+        const long pair_n = initial_feature_n*basis_n;
+        const long block_size = admission ? candidate_block_size : std::max(pair_n,1l);
+        vector<double> admitted_scores;
+        for(long block_begin=0; block_begin<pair_n; block_begin+=block_size) {
+            const long block_end = std::min(block_begin+block_size,pair_n);
+            const int block_n = block_end-block_begin;
+            int chunk_n = chunk_number();
+            vector<vector<int>> chunk_pools(chunk_n), chunk_sizes(chunk_n);
+            #ifdef USE_OMP
+            #pragma omp parallel for schedule(static,1) collapse(1)
+            #endif
+            for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+                auto basis_less = [this](int a, int b){return feature_set.basis_less(a,b);};
+                auto & pool = chunk_pools[chunk_idx];
+                auto & sizes = chunk_sizes[chunk_idx];
+                vector<int> feature;
+                const long end = block_begin+chunk_begin(block_n,chunk_idx+1,chunk_n);
+                for(long pair_idx=block_begin+chunk_begin(block_n,chunk_idx,chunk_n); pair_idx<end; ++pair_idx) {
+                    const auto initial_feature = feature_set[pair_idx/basis_n];
+                    const int basis_idx = candidate_basis[pair_idx%basis_n];
+                    {
+                        // insert at canonical position (skip if already contained)
+                        auto pos = std::lower_bound(initial_feature.begin(),initial_feature.end(),basis_idx,basis_less);
+                        if(pos!=initial_feature.end() && *pos==basis_idx) continue;
+                        feature.assign(initial_feature.begin(),pos);
+                        feature.push_back(basis_idx);
+                        feature.insert(feature.end(),pos,initial_feature.end());
+                        // skip contradictory features (same type, same time, different
+                        // value), which can only occur next to the new basis feature
+                        int new_pos = pos-initial_feature.begin();
+                        int begin = std::max(new_pos-1,0);
+                        int end = std::min(new_pos+2,(int)feature.size());
+                        if(feature_set.is_contradictory(feature.data()+begin,feature.data()+end)) continue;
+                        // Skip features that do not refer to the outcome.
+                        // They are constant across outcomes and cancel out
+                        // (the gradient of their weight is always zero).
+                        // Candidates of features that do refer to it are
+                        // also generated from another initial feature.
+                        if(!feature_set.refers_to_outcome(feature.data(),feature.data()+feature.size())) continue;
+                        // skip existing features
+                        if(feature_set.find(feature.data(),feature.data()+feature.size())>=0) continue;
+                        pool.insert(pool.end(),feature.begin(),feature.end());
+                        sizes.push_back(feature.size());
                     }
                 }
+            } // end parallel
+            // merge
+            std::size_t candidate_n = 0, basis_n = 0;
+            for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+                candidate_n += chunk_sizes[chunk_idx].size();
+                basis_n += chunk_pools[chunk_idx].size();
+            }
+            int merged_n = feature_set.size();
+            feature_set.reserve(candidate_n,basis_n);
+            for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+                const int * candidate = chunk_pools[chunk_idx].data();
+                for(auto size : chunk_sizes[chunk_idx]) {
+                    feature_set.insert(candidate,candidate+size);
+                    candidate += size;
+                }
+            }
+            // drop candidates that are (almost) never active
+            if(min_support>0) {
+                prune_candidates(merged_n);
+            }
+            // only admit the most promising candidates
+            if(admission) {
+                admit_candidates(initial_feature_n,merged_n,admitted_scores);
             }
-            // increment
-            if(!deleted) ++feature_it;
-        }
-        // restore values from initial feature set
-        for(auto & feature : initial_feature_set) {
-            feature_set[feature.first] = feature.second;
         }
     }
     // print
-    DEBUG_OUT(3,"Expanded feature set (" << initial_feature_set.size() << " --> " << feature_set.size() << ")");
+    DEBUG_OUT(3,"Expanded feature set (" << initial_feature_n << " --> " << feature_set.size() << ")");
     IF_DEBUG(6) {
         print_feature_set();
     }
 }
 
+void TemporallyExtendedModel::admit_candidates(int old_feature_n,
+                                               int new_begin,
+                                               vector<double> & admitted_scores) {
+    DEBUG_OUT(3,"Scoring candidate features");
+    DEBUG_INDENT;
+    DEBUG_EXPECT((int)admitted_scores.size()==new_begin-old_feature_n);
+    // compute partial derivatives of new candidates (candidates admitted
+    // before keep their scores)
+    vector<int> candidates(feature_set.size()-new_begin);
+    std::iota(candidates.begin(),candidates.end(),new_begin);
+    vector<double> scores;
+    switch(admission_score) {
+    case GRADIENT:
+        candidate_gradients(candidates,scores);
+        break;
+    case SUPPORT:
+        candidate_support(candidates,scores);
+        break;
+    }
+    scores.insert(scores.begin(),admitted_scores.begin(),admitted_scores.end());
+    // rank candidates by their score (ties broken by order in feature set)
+    vector<std::pair<double,int>> ranking;
+    for(int candidate_idx=0; candidate_idx<(int)scores.size(); ++candidate_idx) {
+        double score = fabs(scores[candidate_idx]);
+        if(score>candidate_threshold) {
+            ranking.push_back(std::make_pair(-score,candidate_idx));
+        }
+    }
+    if(max_candidates>0 && (int)ranking.size()>max_candidates) {
+        std::nth_element(ranking.begin(),ranking.begin()+max_candidates,ranking.end());
+        ranking.resize(max_candidates);
+    }
+    // remove the others (keeping the scores of admitted candidates in order)
+    vector<bool> keep(feature_set.size(),false);
+    std::fill(keep.begin(),keep.begin()+old_feature_n,true);
+    for(auto & rank : ranking) {
+        keep[old_feature_n+rank.second] = true;
+    }
+    admitted_scores.clear();
+    for(int candidate_idx=0; candidate_idx<(int)scores.size(); ++candidate_idx) {
+        if(keep[old_feature_n+candidate_idx]) admitted_scores.push_back(scores[candidate_idx]);
+    }
+    feature_set.erase(keep);
+    DEBUG_OUT(3,"Admitted " << ranking.size() << " of " << scores.size() << " candidates");
+}
+
 void TemporallyExtendedModel::shrink_feature_set() {
     int old_size = feature_set.size();
-    for(auto feature_it = feature_set.begin(); feature_it!=feature_set.end(); /*increment manually*/) {
-        if(feature_it->second==0) {
-            auto delete_feature_it = feature_it;
-            ++feature_it;
-            feature_set.erase(delete_feature_it);
-        } else {
-            ++feature_it;
-        }
+    vector<bool> keep(feature_set.size());
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        keep[feature_idx] = feature_set.weight(feature_idx)!=0;
     }
+    feature_set.erase(keep);
     // print
     DEBUG_OUT(3,"Shrunk feature set (" << old_size << " --> " << feature_set.size() << ")");
     IF_DEBUG(6) {
@@ -413,10 +1081,10 @@ void TemporallyExtendedModel::shrink_feature_set() {
 
 void TemporallyExtendedModel::print_feature_set() {
     int f_idx = 1;
-    for(auto & feature : feature_set) {
-        cout << "Feature " << f_idx << " (" << feature.second << ")" << endl;
-        for(auto & basis_feature : feature.first) {
-            cout << "    " << basis_feature << endl;
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        cout << "Feature " << f_idx << " (" << feature_set.weight(feature_idx) << ")" << endl;
+        for(auto basis_idx : feature_set[feature_idx]) {
+            cout << "    " << feature_set.basis_feature(basis_idx) << endl;
         }
         cout << endl;
         ++f_idx;
@@ -424,162 +1092,1058 @@ void TemporallyExtendedModel::print_feature_set() {
     if(f_idx==1) cout << "    empty" << endl;
 }
 
+bool TemporallyExtendedModel::save(const std::string & file_name) const {
+    DEBUG_OUT(1,"Saving model to '" << file_name << "'");
+    // settings
+    std::int32_t horizon[2] = {horizon_extension,maximum_horizon};
+    // outcome tables
+    vector<std::int32_t> actions(unique_actions.begin(),unique_actions.end());
+    vector<std::int32_t> observations(unique_observations.begin(),unique_observations.end());
+    vector<double> rewards(unique_rewards.begin(),unique_rewards.end());
+    vector<std::int32_t> observation_column(outcome_observations.begin(),outcome_observations.end());
+    std::int32_t outcome_flags[2] = {observed_outcomes,outcome_slot};
+    // basis features (columns)
+    int basis_n = feature_set.basis_feature_number();
+    vector<std::int32_t> basis_types(basis_n), basis_times(basis_n);
+    vector<double> basis_values(basis_n);
+    for(int basis_idx=0; basis_idx<basis_n; ++basis_idx) {
+        BASIS_FEATURE(tuple, type, time, value);
+        tuple = feature_set.basis_feature(basis_idx);
+        basis_types[basis_idx] = type;
+        basis_times[basis_idx] = time;
+        basis_values[basis_idx] = value;
+    }
+    // features (as in FeatureSet) and weights
+    vector<std::uint64_t> feature_ptr(1,0);
+    vector<std::int32_t> basis_pool;
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        for(auto basis_idx : feature_set[feature_idx]) {
+            basis_pool.push_back(basis_idx);
+        }
+        feature_ptr.push_back(basis_pool.size());
+    }
+    // write
+    FILE * file = fopen(file_name.c_str(),"wb");
+    if(file==nullptr) {
+        DEBUG_WARNING("Could not open '" << file_name << "' for writing");
+        return false;
+    }
+    bool ok = write_array(file,model_magic,sizeof(model_magic)) &&
+        write_array(file,&model_version,1) &&
+        write_array(file,&regularization,1) &&
+        write_array(file,horizon,2) &&
+        write_vector(file,actions) &&
+        write_vector(file,observations) &&
+        write_vector(file,rewards) &&
+        write_vector(file,observation_column) &&
+        write_vector(file,outcome_rewards) &&
+        write_array(file,outcome_flags,2) &&
+        write_vector(file,basis_types) &&
+        write_vector(file,basis_times) &&
+        write_vector(file,basis_values) &&
+        write_vector(file,feature_ptr) &&
+        write_vector(file,basis_pool) &&
+        write_vector(file,feature_set.weights());
+    ok = fclose(file)==0 && ok;
+    if(!ok) {
+        DEBUG_WARNING("Could not write '" << file_name << "'");
+    }
+    return ok;
+}
+
+bool TemporallyExtendedModel::load(const std::string & file_name) {
+    DEBUG_OUT(1,"Loading model from '" << file_name << "'");
+    // map file
+    int fd = open(file_name.c_str(),O_RDONLY);
+    if(fd<0) {
+        DEBUG_WARNING("Could not open '" << file_name << "'");
+        return false;
+    }
+    struct stat file_stat;
+    if(fstat(fd,&file_stat)!=0 || file_stat.st_size==0) {
+        close(fd);
+        return false;
+    }
+    std::size_t length = file_stat.st_size;
+    void * address = mmap(nullptr,length,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(address==MAP_FAILED) return false;
+    MappedReader reader((const char*)address,length);
+    // read header and sections
+    char magic[sizeof(model_magic)];
+    std::uint32_t version = 0;
+    double file_regularization;
+    std::int32_t horizon[2];
+    vector<std::int32_t> actions, observations, basis_types, basis_times, basis_pool;
+    vector<double> rewards, basis_values, weights;
+    // outcome tables (version 2 and above, all combinations before)
+    vector<std::int32_t> observation_column;
+    vector<double> reward_column;
+    std::int32_t outcome_flags[2] = {false,false};
+    vector<std::uint64_t> feature_ptr;
+    bool ok = reader.read_array(magic,sizeof(magic)) &&
+        std::memcmp(magic,model_magic,sizeof(model_magic))==0 &&
+        reader.read_array(&version,1) &&
+        version>=1 && version<=model_version &&
+        reader.read_array(&file_regularization,1) &&
+        reader.read_array(horizon,2) &&
+        reader.read_vector(actions) &&
+        reader.read_vector(observations) &&
+        reader.read_vector(rewards) &&
+        (version<2 || (reader.read_vector(observation_column) &&
+                       reader.read_vector(reward_column) &&
+                       reader.read_array(outcome_flags,2))) &&
+        reader.read_vector(basis_types) &&
+        reader.read_vector(basis_times) &&
+        reader.read_vector(basis_values) &&
+        reader.read_vector(feature_ptr) &&
+        reader.read_vector(basis_pool) &&
+        reader.read_vector(weights) &&
+        reader.at_end();
+    munmap(address,length);
+    // check consistency
+    int basis_n = basis_types.size();
+    int feature_n = weights.size();
+    ok = ok && observation_column.size()==reward_column.size() &&
+        (int)basis_times.size()==basis_n && (int)basis_values.size()==basis_n &&
+        (int)feature_ptr.size()==feature_n+1 && feature_ptr.front()==0 &&
+        feature_ptr.back()==basis_pool.size();
+    for(int feature_idx=0; ok && feature_idx<feature_n; ++feature_idx) {
+        ok = feature_ptr[feature_idx]<=feature_ptr[feature_idx+1];
+    }
+    for(std::size_t outcome_idx=1; ok && outcome_idx<observation_column.size(); ++outcome_idx) {
+        ok = std::make_pair(observation_column[outcome_idx-1],reward_column[outcome_idx-1]) <
+            std::make_pair(observation_column[outcome_idx],reward_column[outcome_idx]);
+    }
+    for(int basis_idx=0; ok && basis_idx<basis_n; ++basis_idx) {
+        ok = basis_types[basis_idx]>=ACTION && basis_types[basis_idx]<=REWARD;
+    }
+    for(auto basis_idx : basis_pool) {
+        if(!ok) break;
+        ok = basis_idx>=0 && basis_idx<basis_n;
+    }
+    // build feature set (basis features are interned in the same order so
+    // the indices remain valid unless there are duplicates) and check that
+    // features are canonical, not contradictory, and unique (otherwise
+    // insert() would silently drop weights)
+    feature_set_t new_feature_set;
+    for(int basis_idx=0; ok && basis_idx<basis_n; ++basis_idx) {
+        ok = new_feature_set.intern(basis_feature_t((FEATURE_TYPE)basis_types[basis_idx],
+                                                    basis_times[basis_idx],
+                                                    basis_values[basis_idx]))==basis_idx;
+    }
+    vector<int> basis;
+    for(int feature_idx=0; ok && feature_idx<feature_n; ++feature_idx) {
+        const int * begin = basis_pool.data()+feature_ptr[feature_idx];
+        const int * end = basis_pool.data()+feature_ptr[feature_idx+1];
+        basis.assign(begin,end);
+        new_feature_set.canonicalize(basis);
+        ok = (int)basis.size()==end-begin && std::equal(begin,end,basis.begin()) &&
+            !new_feature_set.is_contradictory(begin,end) &&
+            new_feature_set.find(begin,end)<0;
+        if(ok) new_feature_set.insert(begin,end,weights[feature_idx]);
+    }
+    if(!ok) {
+        DEBUG_WARNING("'" << file_name << "' is not a valid model file");
+        return false;
+    }
+    // build model
+    regularization = file_regularization;
+    horizon_extension = horizon[0];
+    maximum_horizon = horizon[1];
+    unique_actions = std::set<int>(actions.begin(),actions.end());
+    unique_observations = std::set<int>(observations.begin(),observations.end());
+    unique_rewards = std::set<double>(rewards.begin(),rewards.end());
+    observed_outcomes = outcome_flags[0];
+    outcome_slot = outcome_flags[1];
+    if(version<2) {
+        outcome_product(unique_observations,unique_rewards,outcome_observations,outcome_rewards);
+    } else {
+        outcome_observations.assign(observation_column.begin(),observation_column.end());
+        outcome_rewards = reward_column;
+    }
+    feature_set = new_feature_set;
+    // discard data
+    data = DataView();
+    episode_begins.assign(1,0);
+    outcome_indices.clear();
+    basis_truth.reset(0);
+    F_matrices.reset(0,0);
+    F_matrix_feature_ids.clear();
+    outcome_probabilities.reset();
+    optimum_feature_ids.clear();
+    DEBUG_OUT(1,"Loaded " << feature_set.size() << " features (version " << version << ")");
+    return true;
+}
+
 void TemporallyExtendedModel::update_F_matrices() {
     DEBUG_OUT(4,"update F-matrices");
     DEBUG_INDENT;
-    F_matrices.assign(data.size(),
-                      zeros<mat_t>(feature_set.size(),
-                                   unique_observations.size()*unique_rewards.size()));
+    int feature_n = feature_set.size();
+    int outcome_n = outcome_number();
+    int data_n = data.size();
+    // Rows of features that are already in the F-matrices are reused (removed
+    // features are dropped) and only new features are evaluated. Feature ids
+    // are increasing within both F_matrix_feature_ids and feature_set so we
+    // can walk through them in parallel.
+    bool reuse = F_matrices.size()==data_n &&
+        F_matrices.n_cols()==outcome_n &&
+        F_matrices.n_rows()==(int)F_matrix_feature_ids.size();
+    vector<int> old_to_new_row;            // -1 for removed features
+    vector<int> new_features;
+    int reused_n = 0;
+    {
+        auto old_it = F_matrix_feature_ids.begin();
+        for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+            auto id = feature_set.id(feature_idx);
+            while(reuse && old_it!=F_matrix_feature_ids.end() && *old_it<id) {
+                old_to_new_row.push_back(-1);
+                ++old_it;
+            }
+            if(reuse && old_it!=F_matrix_feature_ids.end() && *old_it==id) {
+                old_to_new_row.push_back(feature_idx);
+                ++reused_n;
+                ++old_it;
+            } else {
+                new_features.push_back(feature_idx);
+            }
+        }
+        if(reuse) old_to_new_row.resize(F_matrix_feature_ids.size(),-1);
+    }
+    if(reuse && new_features.empty() && reused_n==(int)F_matrix_feature_ids.size()) {
+        DEBUG_OUT(4,"F-matrices up to date");
+        return;
+    }
+    DEBUG_OUT(4,"reuse " << reused_n << " and evaluate " << new_features.size() << " features");
+    update_outcome_indices();
+    // use F-matrices from file if they exist (mapping fails otherwise)
+    std::uint64_t signature = 0;
+    if(!F_matrix_file.empty()) {
+        signature = F_matrix_signature();
+        FMatrixStore stored;
+        if(stored.map(F_matrix_file,signature,feature_n,outcome_n)) {
+            if(stored.size()==data_n) {
+                DEBUG_OUT(4,"mapped F-matrices from '" << F_matrix_file << "'");
+                F_matrices = stored;
+                F_matrix_feature_ids.clear();
+                for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+                    F_matrix_feature_ids.push_back(feature_set.id(feature_idx));
+                }
+                update_contexts();
+                return;
+            }
+            DEBUG_WARNING("'" << F_matrix_file << "' has " << stored.size()
+                          << " F-matrices instead of " << data_n << ", recomputing");
+        }
+    }
+    // evaluate new features via basis truth tables
+    update_basis_truth();
+    FeaturePlan plan;
+    plan_features(new_features,plan);
+    // fill F-matrices of contiguous chunks of data points (in units of
+    // truth table words) in parallel and concatenate them afterwards. With
+    // a file, every chunk writes its F-matrices to a segment file after each
+    // word so that only one word per thread is held in memory (the old
+    // F-matrices may still be mapped so we write to a new file and replace
+    // the old one).
+    int word_n = basis_truth.word_number();
+    int chunk_n = chunk_number();
+    bool to_file = !F_matrix_file.empty();
+    std::string tmp_file = F_matrix_file+".tmp";
+    vector<std::string> segment_names;
+    for(int chunk_idx=0; to_file && chunk_idx<chunk_n; ++chunk_idx) {
+        segment_names.push_back(tmp_file+"."+std::to_string(chunk_idx));
+    }
+    vector<FMatrixStore> chunks(chunk_n,FMatrixStore(feature_n,outcome_n));
+    vector<char> segments_ok(chunk_n,true);
     int progress = 0;
     #ifdef USE_OMP
-    #pragma omp parallel for schedule(static) collapse(1)
+    #pragma omp parallel for schedule(static,1) collapse(1)
     #endif
-    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
-        DEBUG_OUT(6,"data point " << data_idx);
-        DEBUG_INDENT;
-        fill_F_matrix(feature_set,
-                      unique_actions,
-                      unique_observations,
-                      unique_rewards,
-                      data,
-                      data_idx,
-                      F_matrices[data_idx],
-                      outcome_indices[data_idx]);
-        DEBUG_EXPECT(outcome_indices[data_idx]>=0);
-        #ifdef USE_OMP
-        #pragma omp critical (TemporallyExtendedModel)
-        #endif
-        {
-            ++progress;
-            IF_DEBUG(4) {
-                cout << "\r" << (100*progress)/data.size() << "%    " << std::flush;
-                IF_DEBUG(6) cout << endl;
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        FMatrixStore new_F_matrices(new_features.size(),outcome_n);
+        FillBuffers buffers;
+        std::unique_ptr<FMatrixStore::SegmentWriter> segment;
+        if(to_file) segment.reset(new FMatrixStore::SegmentWriter(segment_names[chunk_idx]));
+        int end = chunk_begin(word_n,chunk_idx+1,chunk_n);
+        for(int word_idx=chunk_begin(word_n,chunk_idx,chunk_n); word_idx<end; ++word_idx) {
+            // evaluate new features
+            new_F_matrices.reset(new_features.size(),outcome_n);
+            fill_F_matrices(plan,basis_truth,word_idx,new_F_matrices,buffers);
+            for(int bit_idx=0; bit_idx<new_F_matrices.size(); ++bit_idx) {
+                int data_idx = word_idx*TruthTable::word_bits+bit_idx;
+                DEBUG_OUT(6,"data point " << data_idx);
+                // merge with reused rows (both are sorted by their new row index)
+                auto & chunk = chunks[chunk_idx];
+                const auto new_F = new_F_matrices[bit_idx];
+                for(int outcome_idx=0; outcome_idx<outcome_n; ++outcome_idx) {
+                    auto new_it = new_F.begin(outcome_idx);
+                    if(reuse) {
+                        const auto old_F = F_matrices[data_idx];
+                        for(auto old_it=old_F.begin(outcome_idx); old_it!=old_F.end(outcome_idx); ++old_it) {
+                            int row = old_to_new_row[*old_it];
+                            if(row<0) continue;
+                            while(new_it!=new_F.end(outcome_idx) && new_features[*new_it]<row) {
+                                chunk.push_back(new_features[*new_it]);
+                                ++new_it;
+                            }
+                            chunk.push_back(row);
+                        }
+                    }
+                    for(; new_it!=new_F.end(outcome_idx); ++new_it) {
+                        chunk.push_back(new_features[*new_it]);
+                    }
+                    chunk.end_column();
+                }
             }
-        } // end critical
+            if(segment) segments_ok[chunk_idx] = segment->write(chunks[chunk_idx]);
+            #ifdef USE_OMP
+            #pragma omp critical (TemporallyExtendedModel)
+            #endif
+            {
+                ++progress;
+                IF_DEBUG(4) {
+                    cout << "\r" << (100*progress)/word_n << "%    " << std::flush;
+                    IF_DEBUG(6) cout << endl;
+                }
+            } // end critical
+        }
+        if(segment) segments_ok[chunk_idx] = segment->close() && segments_ok[chunk_idx];
     } // end parallel
+    // combine segments into the file and map it or concatenate in memory
+    if(to_file) {
+        bool mapped = std::count(segments_ok.begin(),segments_ok.end(),false)==0;
+        mapped = FMatrixStore::concatenate(segment_names,feature_n,outcome_n,tmp_file,signature) && mapped;
+        mapped = mapped &&
+            rename(tmp_file.c_str(),F_matrix_file.c_str())==0 &&
+            F_matrices.map(F_matrix_file,signature,feature_n,outcome_n);
+        if(!mapped) {
+            // the F-matrices were not kept in memory so compute them again
+            DEBUG_WARNING("Could not use '" << F_matrix_file << "', keeping F-matrices in memory");
+            std::remove(tmp_file.c_str());
+            std::string file_name = F_matrix_file;
+            F_matrix_file.clear();
+            update_F_matrices();
+            F_matrix_file = file_name;
+            return;
+        }
+    } else {
+        F_matrices.reset(feature_n,outcome_n);
+        F_matrices.assemble(chunks);
+    }
+    F_matrix_feature_ids.clear();
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        F_matrix_feature_ids.push_back(feature_set.id(feature_idx));
+    }
     IF_DEBUG(4) {
         IF_DEBUG(6);// nothing to do
         else cout << endl;
     }
+    DEBUG_OUT(4,"F-matrices use " << F_matrices.memory()/1024 << " kB ("
+              << F_matrices.non_zero() << " non-zero entries)");
+    update_contexts();
+}
+
+void TemporallyExtendedModel::update_contexts() {
+    int data_n = data.size();
+    int outcome_n = F_matrices.n_cols();
+    DEBUG_EXPECT(F_matrices.size()==data_n);
+    // hash F-matrices in parallel
+    vector<std::size_t> hashes(data_n);
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static) collapse(1)
+    #endif
+    for(int data_idx=0; data_idx<data_n; ++data_idx) {
+        hashes[data_idx] = F_matrices[data_idx].hash();
+    }
+    // assign contexts in order of their first data point (via an
+    // open-addressing hash table with load factor below 1/2)
+    std::size_t slot_n = 16;
+    while(slot_n<2*(std::size_t)data_n) slot_n *= 2;
+    const std::size_t mask = slot_n-1;
+    vector<int> table(slot_n,-1);
+    data_context.resize(data_n);
+    context_data.clear();
+    for(int data_idx=0; data_idx<data_n; ++data_idx) {
+        const auto F = F_matrices[data_idx];
+        std::size_t slot = hashes[data_idx]&mask;
+        for(; table[slot]>=0; slot=(slot+1)&mask) {
+            int first_idx = context_data[table[slot]];
+            if(hashes[first_idx]==hashes[data_idx] && F_matrices[first_idx]==F) break;
+        }
+        if(table[slot]<0) {
+            table[slot] = context_data.size();
+            context_data.push_back(data_idx);
+        }
+        data_context[data_idx] = table[slot];
+    }
+    // count outcomes per context (sorting data points by context first)
+    int context_n = context_data.size();
+    vector<int> context_begin(context_n+1,0), sorted_data(data_n);
+    for(int data_idx=0; data_idx<data_n; ++data_idx) {
+        ++context_begin[data_context[data_idx]+1];
+    }
+    std::partial_sum(context_begin.begin(),context_begin.end(),context_begin.begin());
+    {
+        vector<int> next(context_begin.begin(),context_begin.end()-1);
+        for(int data_idx=0; data_idx<data_n; ++data_idx) {
+            sorted_data[next[data_context[data_idx]]++] = data_idx;
+        }
+    }
+    context_ptr.assign(1,0);
+    context_outcomes.clear();
+    context_counts.clear();
+    context_sizes.assign(context_n,0);
+    vector<double> counts(outcome_n,0);
+    for(int context_idx=0; context_idx<context_n; ++context_idx) {
+        for(int idx=context_begin[context_idx]; idx<context_begin[context_idx+1]; ++idx) {
+            int outcome_idx = outcome_indices[sorted_data[idx]];
+            DEBUG_EXPECT(outcome_idx>=0);
+            counts[outcome_idx] += 1;
+        }
+        for(int outcome_idx=0; outcome_idx<outcome_n; ++outcome_idx) {
+            if(counts[outcome_idx]>0) {
+                context_outcomes.push_back(outcome_idx);
+                context_counts.push_back(counts[outcome_idx]);
+                context_sizes[context_idx] += counts[outcome_idx];
+                counts[outcome_idx] = 0;
+            }
+        }
+        context_ptr.push_back(context_outcomes.size());
+    }
+    // cached linear terms refer to the old contexts
+    last_lin_idx = -1;
+    line_valid = false;
+    // pack the F-matrices of all contexts. This copy costs the memory of
+    // one F-matrix per context, so it is only made if there are on average
+    // at least context_packing_ratio data points per context and never if
+    // the F-matrices are memory-mapped (to keep them out of RAM). Otherwise
+    // contexts use the F-matrix of their first data point.
+    context_F_store = FMatrixStore(F_matrices.n_rows(),outcome_n);
+    if(context_n<data_n &&
+       (long)context_n*context_packing_ratio<=(long)data_n &&
+       !F_matrices.is_mapped()) {
+        for(auto data_idx : context_data) {
+            const auto F = F_matrices[data_idx];
+            for(int outcome_idx=0; outcome_idx<outcome_n; ++outcome_idx) {
+                for(auto row_ptr=F.begin(outcome_idx); row_ptr!=F.end(outcome_idx); ++row_ptr) {
+                    context_F_store.push_back(*row_ptr);
+                }
+                context_F_store.end_column();
+            }
+        }
+    }
+    DEBUG_OUT(4,data_n << " data points in " << context_n << " contexts");
+}
+
+std::uint64_t TemporallyExtendedModel::F_matrix_signature() const {
+    // FNV-1a over data points, episodes, outcomes, and features (field by
+    // field to skip padding)
+    std::uint64_t h = 14695981039346656037ull;
+    auto add = [&h](const void * bytes, std::size_t n) {
+        for(std::size_t idx=0; idx<n; ++idx) {
+            h ^= ((const unsigned char*)bytes)[idx];
+            h *= 1099511628211ull;
+        }
+    };
+    std::uint64_t data_n = data.size();
+    add(&data_n,sizeof(data_n));
+    for(std::size_t data_idx=0; data_idx<data.size(); ++data_idx) {
+        const auto point = data[data_idx];
+        add(&point.action,sizeof(point.action));
+        add(&point.observation,sizeof(point.observation));
+        add(&point.reward,sizeof(point.reward));
+    }
+    std::uint64_t episode_n = episode_begins.size();
+    add(&episode_n,sizeof(episode_n));
+    for(auto begin : episode_begins) {
+        std::int64_t begin_64 = begin;
+        add(&begin_64,sizeof(begin_64));
+    }
+    std::int32_t outcome_flags[2] = {observed_outcomes,outcome_slot};
+    add(outcome_flags,sizeof(outcome_flags));
+    std::uint64_t table_n = outcome_observations.size();
+    add(&table_n,sizeof(table_n));
+    for(int outcome_idx=0; outcome_idx<(int)table_n; ++outcome_idx) {
+        add(&outcome_observations[outcome_idx],sizeof(observation_t));
+        add(&outcome_rewards[outcome_idx],sizeof(reward_t));
+    }
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        int basis_n = feature_set[feature_idx].size();
+        add(&basis_n,sizeof(basis_n));
+        for(auto basis_idx : feature_set[feature_idx]) {
+            BASIS_FEATURE(tuple, type, time, value);
+            tuple = feature_set.basis_feature(basis_idx);
+            int type_int = type;
+            add(&type_int,sizeof(type_int));
+            add(&time,sizeof(time));
+            add(&value,sizeof(value));
+        }
+    }
+    return h;
+}
+
+void TemporallyExtendedModel::update_outcome_probabilities() {
+    DEBUG_OUT(4,"update outcome probabilities");
+    int data_n = data.size();
+    int outcome_n = F_matrices.n_cols();
+    DEBUG_EXPECT(F_matrices.size()==data_n);
+    DEBUG_EXPECT(F_matrices.n_rows()==(int)feature_set.size());
+    const double * w = feature_set.weights().data();
+    // compute explin/z once per context (for its first data point) and copy
+    // it to the other data points of the context
+    outcome_probabilities.set_size(outcome_n,data_n);
+    int context_n = context_data.size();
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static) collapse(1)
+    #endif
+    for(int context_idx=0; context_idx<context_n; ++context_idx) {
+        int data_idx = context_data[context_idx];
+        double * p = outcome_probabilities.colptr(data_idx);
+        context_F_matrix(context_idx).transposed_product(w,p);
+        softmax(p,outcome_n);
+    }
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static) collapse(1)
+    #endif
+    for(int data_idx=0; data_idx<data_n; ++data_idx) {
+        int first_idx = context_data[data_context[data_idx]];
+        if(first_idx!=data_idx) {
+            const double * p = outcome_probabilities.colptr(first_idx);
+            std::copy(p,p+outcome_n,outcome_probabilities.colptr(data_idx));
+        }
+    }
+}
+
+void TemporallyExtendedModel::candidate_gradients(const vector<int> & candidates,
+                                                  vector<double> & gradient) {
+    DEBUG_OUT(4,"compute gradient of " << candidates.size() << " candidates");
+    int candidate_n = candidates.size();
+    int outcome_n = outcome_number();
+    int data_n = data.size();
+    DEBUG_EXPECT((int)outcome_probabilities.n_rows==outcome_n);
+    DEBUG_EXPECT((int)outcome_probabilities.n_cols==data_n);
+    // The candidate F-matrices are only computed temporarily (for 64 data
+    // points at a time) and each chunk of data points accumulates its own
+    // gradient (see neg_log_likelihood()).
+    update_basis_truth();
+    FeaturePlan plan;
+    plan_features(candidates,plan);
+    int word_n = basis_truth.word_number();
+    int chunk_n = chunk_number();
+    mat_t chunk_gradients = zeros<mat_t>(candidate_n,chunk_n);
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static,1) collapse(1)
+    #endif
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        FMatrixStore F_tilde(candidate_n,outcome_n);
+        FillBuffers buffers;
+        vector<double> factors(outcome_n);
+        int end = chunk_begin(word_n,chunk_idx+1,chunk_n);
+        for(int word_idx=chunk_begin(word_n,chunk_idx,chunk_n); word_idx<end; ++word_idx) {
+            F_tilde.reset(candidate_n,outcome_n);
+            fill_F_matrices(plan,basis_truth,word_idx,F_tilde,buffers);
+            for(int bit_idx=0; bit_idx<F_tilde.size(); ++bit_idx) {
+                int data_idx = word_idx*TruthTable::word_bits+bit_idx;
+                int outcome_idx = outcome_indices[data_idx];
+                DEBUG_EXPECT(outcome_idx>=0);
+                // gradient term of negative log-likelihood is F*explin/z - F.col(outcome_idx)
+                const double * p = outcome_probabilities.colptr(data_idx);
+                for(int idx=0; idx<outcome_n; ++idx) {
+                    factors[idx] = p[idx];
+                }
+                factors[outcome_idx] -= 1;
+                F_tilde[bit_idx].add_product(factors.data(),chunk_gradients.colptr(chunk_idx));
+            }
+        }
+    } // end parallel
+    // merge chunks and divide by number of data points
+    gradient.assign(candidate_n,0);
+    for(int candidate_idx=0; candidate_idx<candidate_n; ++candidate_idx) {
+        for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+            gradient[candidate_idx] += chunk_gradients(candidate_idx,chunk_idx);
+        }
+        if(data_n>0) {
+            gradient[candidate_idx] /= data_n;
+        }
+    }
+}
+
+void TemporallyExtendedModel::candidate_support(const vector<int> & candidates,
+                                                vector<double> & support) {
+    vector<long> counts;
+    support_counts(candidates,true,counts);
+    int data_n = data.size();
+    support.resize(candidates.size());
+    for(int candidate_idx=0; candidate_idx<(int)candidates.size(); ++candidate_idx) {
+        support[candidate_idx] = data_n>0 ? (double)counts[candidate_idx]/data_n : 0;
+    }
+}
+
+void TemporallyExtendedModel::support_counts(const vector<int> & candidates,
+                                             bool observed_outcome,
+                                             vector<long> & counts) {
+    DEBUG_OUT(4,"count support of " << candidates.size() << " candidates");
+    typedef TruthTable::word_t word_t;
+    int candidate_n = candidates.size();
+    int outcome_n = outcome_number();
+    // A candidate is active for a data point if all its basis features
+    // referring to the history are true (AND of truth table columns). It is
+    // true if additionally the observed outcome is compatible with the
+    // remaining ones.
+    update_basis_truth();
+    FeaturePlan plan;
+    plan_features(candidates,plan);
+    int word_n = basis_truth.word_number();
+    int chunk_n = chunk_number();
+    counts.assign(candidate_n,0);
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static,1) collapse(1)
+    #endif
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        vector<char> compatible(outcome_n);
+        int end = chunk_begin(candidate_n,chunk_idx+1,chunk_n);
+        for(int candidate_idx=chunk_begin(candidate_n,chunk_idx,chunk_n); candidate_idx<end; ++candidate_idx) {
+            auto outcome_begin = plan.outcomes.begin()+plan.outcome_ptr[candidate_idx];
+            auto outcome_end = plan.outcomes.begin()+plan.outcome_ptr[candidate_idx+1];
+            bool all_outcomes = !observed_outcome || outcome_end-outcome_begin==outcome_n;
+            std::fill(compatible.begin(),compatible.end(),false);
+            for(auto it=outcome_begin; it!=outcome_end; ++it) compatible[*it] = true;
+            for(int word_idx=0; word_idx<word_n; ++word_idx) {
+                word_t bits = basis_truth.valid_bits(word_idx);
+                for(auto basis_idx=plan.basis_ptr[candidate_idx];
+                    bits!=0 && basis_idx<plan.basis_ptr[candidate_idx+1];
+                    ++basis_idx) {
+                    bits &= basis_truth.column(plan.basis[basis_idx])[word_idx];
+                }
+                if(all_outcomes) {
+                    counts[candidate_idx] += __builtin_popcountll(bits);
+                } else {
+                    while(bits!=0) {
+                        int data_idx = word_idx*TruthTable::word_bits+__builtin_ctzll(bits);
+                        int outcome_idx = outcome_indices[data_idx];
+                        if(outcome_idx>=0 && compatible[outcome_idx]) ++counts[candidate_idx];
+                        bits &= bits-1;
+                    }
+                }
+            }
+        }
+    } // end parallel
+}
+
+void TemporallyExtendedModel::prune_candidates(int old_feature_n) {
+    vector<int> candidates(feature_set.size()-old_feature_n);
+    std::iota(candidates.begin(),candidates.end(),old_feature_n);
+    vector<long> counts;
+    support_counts(candidates,false,counts);
+    vector<bool> keep(feature_set.size(),true);
+    int removed_n = 0;
+    for(int candidate_idx=0; candidate_idx<(int)candidates.size(); ++candidate_idx) {
+        if(counts[candidate_idx]<min_support) {
+            keep[candidates[candidate_idx]] = false;
+            ++removed_n;
+        }
+    }
+    if(removed_n>0) feature_set.erase(keep);
+    DEBUG_OUT(3,"Pruned " << removed_n << " of " << candidates.size() << " candidates");
+}
+
+void TemporallyExtendedModel::update_basis_truth() {
+    int old_basis_n = basis_truth.column_number();
+    int basis_n = feature_set.basis_feature_number();
+    if(old_basis_n==basis_n) return;
+    DEBUG_OUT(4,"evaluate " << basis_n-old_basis_n << " basis features");
+    DEBUG_EXPECT(basis_truth.data_number()==(int)data.size());
+    for(int basis_idx=old_basis_n; basis_idx<basis_n; ++basis_idx) {
+        basis_truth.add_column();
+    }
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(dynamic,1) collapse(1)
+    #endif
+    for(int basis_idx=old_basis_n; basis_idx<basis_n; ++basis_idx) {
+        evaluate_basis_feature(basis_idx,data,episode_begins,basis_truth,basis_idx);
+    }
+}
+
+void TemporallyExtendedModel::evaluate_basis_feature(int basis_idx,
+                                                     const DataView & data,
+                                                     const vector<int> & episode_begins,
+                                                     TruthTable & truth,
+                                                     int col) const {
+    BASIS_FEATURE(tuple, type, time, value);
+    tuple = feature_set.basis_feature(basis_idx);
+    DEBUG_EXPECT(time<=0);
+    // basis features referring to the outcome are handled by FeaturePlan
+    if(time==0 && type!=ACTION) return;
+    // is the required time index accessible (within the episode) and does
+    // the value match?
+    int episode_n = episode_begins.size();
+    for(int episode_idx=0; episode_idx<episode_n; ++episode_idx) {
+        int end = episode_idx+1<episode_n ? episode_begins[episode_idx+1] : data.size();
+        for(int data_idx=episode_begins[episode_idx]+std::max(-time,0); data_idx<end; ++data_idx) {
+            const auto & point = data[data_idx+time];
+            bool is_true = false;
+            switch(type) {
+            case ACTION:
+                is_true = point.action==value;
+                break;
+            case OBSERVATION:
+                is_true = point.observation==value;
+                break;
+            case REWARD:
+                is_true = point.reward==value;
+                break;
+            }
+            if(is_true) truth.set(col,data_idx);
+        }
+    }
+}
+
+void TemporallyExtendedModel::plan_features(const vector<int> & features, FeaturePlan & plan) const {
+    plan.basis_ptr.assign(1,0);
+    plan.outcome_ptr.assign(1,0);
+    plan.basis.clear();
+    plan.outcomes.clear();
+    for(auto feature_idx : features) {
+        // split into basis features referring to the history and to the outcome
+        bool observation_fixed = false, reward_fixed = false;
+        observation_t fixed_observation = 0;
+        reward_t fixed_reward = 0;
+        for(auto basis_idx : feature_set[feature_idx]) {
+            BASIS_FEATURE(tuple, type, time, value);
+            tuple = feature_set.basis_feature(basis_idx);
+            if(time==0 && type==OBSERVATION) {
+                observation_fixed = true;
+                fixed_observation = value;
+            } else if(time==0 && type==REWARD) {
+                reward_fixed = true;
+                fixed_reward = value;
+            } else {
+                plan.basis.push_back(basis_idx);
+            }
+        }
+        plan.basis_ptr.push_back(plan.basis.size());
+        // outcomes compatible with the remaining basis features (the slot
+        // is only compatible if none refers to the outcome)
+        int table_n = outcome_observations.size();
+        for(int outcome_idx=0; outcome_idx<table_n; ++outcome_idx) {
+            if((!observation_fixed || outcome_observations[outcome_idx]==fixed_observation) &&
+               (!reward_fixed || outcome_rewards[outcome_idx]==fixed_reward)) {
+                plan.outcomes.push_back(outcome_idx);
+            }
+        }
+        if(outcome_slot && !observation_fixed && !reward_fixed) {
+            plan.outcomes.push_back(table_n);
+        }
+        plan.outcome_ptr.push_back(plan.outcomes.size());
+    }
+}
+
+void TemporallyExtendedModel::fill_F_matrices(const FeaturePlan & plan,
+                                              const TruthTable & truth,
+                                              int word_idx,
+                                              FMatrixStore & F_matrices,
+                                              FillBuffers & buffers) const {
+    typedef TruthTable::word_t word_t;
+    const int feature_n = plan.basis_ptr.size()-1;
+    const int outcome_n = F_matrices.n_cols();
+    const word_t valid_bits = truth.valid_bits(word_idx);
+    auto & active_features = buffers.active_features;
+    auto & outcome_features = buffers.outcome_features;
+    active_features.resize(TruthTable::word_bits);
+    outcome_features.resize(outcome_n);
+    for(auto & active : active_features) active.clear();
+    // features are true for those data points where all their basis
+    // features are true (processing 64 data points at once)
+    for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+        word_t bits = valid_bits;
+        for(auto basis_idx=plan.basis_ptr[feature_idx];
+            bits!=0 && basis_idx<plan.basis_ptr[feature_idx+1];
+            ++basis_idx) {
+            bits &= truth.column(plan.basis[basis_idx])[word_idx];
+        }
+        while(bits!=0) {
+            active_features[__builtin_ctzll(bits)].push_back(feature_idx);
+            bits &= bits-1;
+        }
+    }
+    // distribute active features to their outcomes (keeping them sorted)
+    int bit_n = std::min(TruthTable::word_bits,truth.data_number()-word_idx*TruthTable::word_bits);
+    for(int bit_idx=0; bit_idx<bit_n; ++bit_idx) {
+        for(auto feature_idx : active_features[bit_idx]) {
+            for(auto outcome_idx=plan.outcome_ptr[feature_idx];
+                outcome_idx<plan.outcome_ptr[feature_idx+1];
+                ++outcome_idx) {
+                outcome_features[plan.outcomes[outcome_idx]].push_back(feature_idx);
+            }
+        }
+        for(auto & outcome : outcome_features) {
+            for(auto feature_idx : outcome) {
+                F_matrices.push_back(feature_idx);
+            }
+            F_matrices.end_column();
+            outcome.clear();
+        }
+    }
+}
+
+void TemporallyExtendedModel::update_outcome_indices() {
+    int data_n = data.size();
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static) collapse(1)
+    #endif
+    for(int data_idx=0; data_idx<data_n; ++data_idx) {
+        outcome_indices[data_idx] = outcome_index(data[data_idx]);
+    }
+}
+
+int TemporallyExtendedModel::outcome_index(const DataPoint & point) const {
+    // binary search in the (ascending) outcome tables
+    int begin = 0, end = outcome_observations.size();
+    while(begin<end) {
+        int middle = begin+(end-begin)/2;
+        if(outcome_observations[middle]<point.observation ||
+           (outcome_observations[middle]==point.observation && outcome_rewards[middle]<point.reward)) {
+            begin = middle+1;
+        } else {
+            end = middle;
+        }
+    }
+    if(begin<(int)outcome_observations.size() &&
+       outcome_observations[begin]==point.observation &&
+       outcome_rewards[begin]==point.reward) {
+        return begin;
+    }
+    return outcome_slot ? outcome_observations.size() : -1;
 }
 
 void TemporallyExtendedModel::fill_F_matrix(const feature_set_t & feature_set,
-                                            const std::set<int> & unique_actions,
-                                            const std::set<int> & unique_observations,
-                                            const std::set<double> & unique_rewards,
-                                            const data_t & data,
+                                            const vector<int> & features,
+                                            const vector<observation_t> & outcome_observations,
+                                            const vector<reward_t> & outcome_rewards,
+                                            bool outcome_slot,
+                                            const DataView & data,
                                             const int & data_idx,
-                                            mat_t & F_matrix,
+                                            FMatrixStore & F_matrices,
                                             int & matching_outcome_index) {
     matching_outcome_index = -1;
-    int feature_idx = 0; // row index
-    for(auto & feature : feature_set) {
-        DEBUG_OUT(6,"Feature " << feature_idx);
+    int table_n = outcome_observations.size();
+    int outcome_n = table_n+(outcome_slot?1:0);
+    for(int outcome_idx=0; outcome_idx<outcome_n; ++outcome_idx) { // column index
+        // features referring to the outcome are false for the slot
+        const bool slot = outcome_idx==table_n;
+        const observation_t observation = slot ? observation_t() : outcome_observations[outcome_idx];
+        const reward_t reward = slot ? reward_t() : outcome_rewards[outcome_idx];
+        DEBUG_OUT(6,"Outcome " << outcome_idx
+                  << " (" << observation << ", " << reward << ")");
         DEBUG_INDENT;
-        int outcome_idx = 0; // column index
-        for(auto & observation : unique_observations) {
-            for(auto & reward : unique_rewards) {
-                DEBUG_OUT(6,"Outcome " << outcome_idx
-                          << " (" << observation << ", " << reward << ")");
+        // check for matching outcome index
+        if(!slot && observation==data[data_idx].observation && reward==data[data_idx].reward)
+            matching_outcome_index = outcome_idx;
+        for(int feature_idx=0; feature_idx<(int)features.size(); ++feature_idx) { // row index
+            DEBUG_OUT(6,"Feature " << feature_idx);
+            DEBUG_INDENT;
+            // check basis features
+            bool is_true = true;
+            for(auto basis_idx : feature_set[features[feature_idx]]) {
+                const auto & basis_feature = feature_set.basis_feature(basis_idx);
+                //-----------------------------------//
+                // all basis feature have to be true //
+                //-----------------------------------//
+                BASIS_FEATURE(tuple, type, time, value);
+                tuple = basis_feature;
+                DEBUG_EXPECT(time<=0);
+                DEBUG_OUT(6,"Basis feature " << basis_feature);
                 DEBUG_INDENT;
-                // check for matching outcome index
-                if(observation==data[data_idx].observation && reward==data[data_idx].reward)
-                    matching_outcome_index = outcome_idx;
-                // check basis features
-                bool is_true = true;
-                for(auto & basis_feature : feature.first) {
-                    //-----------------------------------//
-                    // all basis feature have to be true //
-                    //-----------------------------------//
-                    BASIS_FEATURE(tuple, type, time, value);
-                    tuple = basis_feature;
-                    DEBUG_EXPECT(time<=0);
-                    DEBUG_OUT(6,"Basis feature " << basis_feature);
-                    DEBUG_INDENT;
-                    // is the required time index accessible?
-                    if(data_idx+time<0) {
-                        DEBUG_OUT(6,"time idx inaccessible");
-                        is_true = false;
-                        break;
-                    }
-                    // does the value match?
-                    switch(type) {
-                    case ACTION:
-                        if(data[data_idx+time].action!=value) is_true = false;
-                        break;
-                    case OBSERVATION:
-                        if(time==0 && observation!=value) is_true = false;
-                        if(time!=0 && data[data_idx+time].observation!=value) is_true = false;
-                        break;
-                    case REWARD:
-                        if(time==0 && reward!=value) is_true = false;
-                        if(time!=0 && data[data_idx+time].reward!=value) is_true = false;
-                        break;
-                    }
-                    // break
-                    if(!is_true) {
-                        DEBUG_OUT(6,"value mismatch");
-                        break;
-                    }
+                // is the required time index accessible?
+                if(data_idx+time<0) {
+                    DEBUG_OUT(6,"time idx inaccessible");
+                    is_true = false;
+                    break;
                 }
-                if(is_true) {
-                    F_matrix(feature_idx,outcome_idx) = 1;
-                    DEBUG_OUT(6,"true");
-                } else {
-                    DEBUG_OUT(6,"false");
+                // does the value match?
+                switch(type) {
+                case ACTION:
+                    if(data[data_idx+time].action!=value) is_true = false;
+                    break;
+                case OBSERVATION:
+                    if(time==0 && (slot || observation!=value)) is_true = false;
+                    if(time!=0 && data[data_idx+time].observation!=value) is_true = false;
+                    break;
+                case REWARD:
+                    if(time==0 && (slot || reward!=value)) is_true = false;
+                    if(time!=0 && data[data_idx+time].reward!=value) is_true = false;
+                    break;
+                }
+                // break
+                if(!is_true) {
+                    DEBUG_OUT(6,"value mismatch");
+                    break;
                 }
-                ++outcome_idx;
+            }
+            if(is_true) {
+                F_matrices.push_back(feature_idx);
+                DEBUG_OUT(6,"true");
+            } else {
+                DEBUG_OUT(6,"false");
             }
         }
-        ++feature_idx;
+        F_matrices.end_column();
     }
+    if(matching_outcome_index<0 && outcome_slot) matching_outcome_index = table_n;
 }
 
 lbfgsfloatval_t TemporallyExtendedModel::neg_log_likelihood(void * instance,
                                                             const lbfgsfloatval_t * weights,
                                                             lbfgsfloatval_t * gradient,
                                                             const int n,
-                                                            const lbfgsfloatval_t /*step*/) {
+                                                            const lbfgsfloatval_t step) {
     DEBUG_OUT(5,"Neg-Log-Likelihood");
     DEBUG_INDENT;
 
-    // weights and gradient use given memory
-    const col_vec_t w(weights,n); // do I really have to copy?!
+    // gradient uses given memory
     col_vec_t grad(gradient,n,false);
 
     // get instance and number of data points
     auto TEM_instance = (TemporallyExtendedModel*)instance;
     int data_n = TEM_instance->data.size();
+    int outcome_n = TEM_instance->F_matrices.n_cols();
 
     // initialize
     lbfgsfloatval_t neg_log_like = 0;
     grad.zeros(TEM_instance->feature_set.size());
 
-    // sum over data points
+    // Every chunk of data points accumulates into its own column of
+    // chunk_gradients and its own objective value. These are merged after
+    // the loop (always in the same order) so no locking is required. All
+    // buffers are members so that repeated evaluations do not allocate.
+    int chunk_n = chunk_number();
+    auto & chunk_gradients = TEM_instance->chunk_gradients;
+    auto & chunk_scratch = TEM_instance->chunk_scratch;
+    auto & chunk_objectives = TEM_instance->chunk_objectives;
+    chunk_gradients.zeros(n,chunk_n);
+    chunk_scratch.set_size(outcome_n*context_block_size,chunk_n);
+    chunk_objectives.assign(chunk_n,0);
+
+    // The linear terms are linear in the weights. During a line search
+    // (step>0) all probed weights usually lie on the line through the first
+    // two evaluated points, so their linear terms can be interpolated from
+    // those of the two points instead of being recomputed.
+    int context_n = TEM_instance->context_data.size();
+    auto & line = TEM_instance->line_lin;
+    auto & current = TEM_instance->current_lin;
+    double t = 0;
+    bool interpolate = step>0 && TEM_instance->line_valid &&
+        on_line(line[0].weights,line[1].weights,weights,n,t);
+    // a computed probe defines a new line starting at the last evaluation
+    // (which is moved to line[0] before current is overwritten)
+    bool new_line = step>0 && !interpolate;
+    if(new_line) {
+        int & last_idx = TEM_instance->last_lin_idx;
+        if(last_idx==1) std::swap(line[0],line[1]);
+        if(last_idx==2) std::swap(line[0],current);
+        TEM_instance->line_valid = last_idx>=0;
+    }
+    current.weights.assign(weights,weights+n);
+    current.lin.set_size(outcome_n,context_n);
+    DEBUG_OUT(5,(interpolate?"interpolate":"compute") << " linear terms (step " << step << ")");
+
+    // sum over contexts (data points with identical F-matrices), each
+    // weighted by how often the different outcomes were observed. The
+    // F-matrices of consecutive contexts are usually packed contiguously in
+    // the context store so that a block of contexts is viewed as one wide
+    // matrix and the sparse products for the linear terms (forward) and the
+    // gradient (backward) run over it in one call with sequential memory
+    // access; otherwise each context is handled separately.
+    const FMatrixStore * context_F = TEM_instance->context_F_matrices();
     #ifdef USE_OMP
-    #pragma omp parallel for schedule(static) collapse(1)
+    #pragma omp parallel for schedule(static,1) collapse(1)
     #endif
-    for(int data_idx=0; data_idx<data_n; ++data_idx) {
-        // use references to improve readability
-        const auto & F = TEM_instance->F_matrices[data_idx];
-        const int & outcome_idx = TEM_instance->outcome_indices[data_idx];
-        // interim variables
-        const row_vec_t lin = w.t()*F;
-        const row_vec_t exp_lin = arma::exp(lin);
-        const double z = arma::sum(exp_lin);
-        // terms of objective and gradient
-        double obj_term = lin(outcome_idx)-log(z);
-        col_vec_t grad_term = F.col(outcome_idx) - F*exp_lin.t()/z;
-        // update objective and gradient
-        #ifdef USE_OMP
-        #pragma omp critical (TemporallyExtendedModel)
-        #endif
-        {
-            neg_log_like += obj_term;
-            grad += grad_term;
-        } // end critical
+    for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+        double * chunk_grad = chunk_gradients.colptr(chunk_idx);
+        double * block_lin = chunk_scratch.colptr(chunk_idx);
+        double chunk_obj = 0;
+        int end = chunk_begin(context_n,chunk_idx+1,chunk_n);
+        for(int first=chunk_begin(context_n,chunk_idx,chunk_n); first<end; first+=context_block_size) {
+            int last = std::min(first+context_block_size,end);
+            int block_n = (last-first)*outcome_n;
+            double * current_lin = current.lin.colptr(first);
+            if(interpolate) {
+                const double * lin_0 = line[0].lin.colptr(first);
+                const double * lin_1 = line[1].lin.colptr(first);
+                for(int idx=0; idx<block_n; ++idx) {
+                    current_lin[idx] = lin_0[idx]+t*(lin_1[idx]-lin_0[idx]);
+                }
+            } else if(context_F!=nullptr) {
+                context_F->block(first,last).transposed_product(weights,current_lin);
+            } else {
+                for(int context_idx=first; context_idx<last; ++context_idx) {
+                    TEM_instance->context_F_matrix(context_idx).transposed_product(weights,current_lin+(context_idx-first)*outcome_n);
+                }
+            }
+            std::copy(current_lin,current_lin+block_n,block_lin);
+            for(int context_idx=first; context_idx<last; ++context_idx) {
+                // linear terms, observed outcomes, and number of data points
+                // of this context
+                double * lin = block_lin+(context_idx-first)*outcome_n;
+                const auto outcome_begin = TEM_instance->context_ptr[context_idx];
+                const auto outcome_end = TEM_instance->context_ptr[context_idx+1];
+                const double n = TEM_instance->context_sizes[context_idx];
+                // objective: counts times linear terms of observed outcomes
+                // minus n times the log-normalization
+                for(auto idx=outcome_begin; idx<outcome_end; ++idx) {
+                    chunk_obj += TEM_instance->context_counts[idx]*lin[TEM_instance->context_outcomes[idx]];
+                }
+                chunk_obj -= n*softmax(lin,outcome_n);
+                // gradient: the term for a single data point is
+                // F.col(outcome_idx) - F*p (with p=exp_lin/z in place of lin)
+                for(int outcome_idx=0; outcome_idx<outcome_n; ++outcome_idx) {
+                    lin[outcome_idx] *= -n;
+                }
+                for(auto idx=outcome_begin; idx<outcome_end; ++idx) {
+                    lin[TEM_instance->context_outcomes[idx]] += TEM_instance->context_counts[idx];
+                }
+            }
+            if(context_F!=nullptr) {
+                context_F->block(first,last).add_product(block_lin,chunk_grad);
+            } else {
+                for(int context_idx=first; context_idx<last; ++context_idx) {
+                    TEM_instance->context_F_matrix(context_idx).add_product(block_lin+(context_idx-first)*outcome_n,chunk_grad);
+                }
+            }
+        }
+        chunk_objectives[chunk_idx] = chunk_obj;
     } // end parallel
 
+    // Update cached linear terms: outside line searches the current point
+    // becomes line[0] (without a second point), a computed probe becomes
+    // line[1], and interpolated probes remain in current.
+    if(step<=0) {
+        std::swap(line[0],current);
+        TEM_instance->line_valid = false;
+        TEM_instance->last_lin_idx = 0;
+    } else if(new_line) {
+        std::swap(line[1],current);
+        TEM_instance->last_lin_idx = 1;
+    } else {
+        TEM_instance->last_lin_idx = 2;
+    }
+
+    // merge chunks
+    #ifdef USE_OMP
+    #pragma omp parallel for schedule(static) collapse(1)
+    #endif
+    for(int feature_idx=0; feature_idx<n; ++feature_idx) {
+        double sum = 0;
+        for(int chunk_idx=0; chunk_idx<chunk_n; ++chunk_idx) {
+            sum += chunk_gradients(feature_idx,chunk_idx);
+        }
+        grad(feature_idx) = sum;
+    }
+    for(auto & obj : chunk_objectives) {
+        neg_log_like += obj;
+    }
+
     // divide by number of data points and reverse sign
     if(data_n>0) {
         neg_log_like = -neg_log_like/data_n;
@@ -592,7 +2156,7 @@ lbfgsfloatval_t TemporallyExtendedModel::neg_log_likelihood(void * instance,
             DEBUG_OUT(6,"weights");
             DEBUG_INDENT;
             for(int idx=0; idx<n; ++idx) {
-                DEBUG_OUT(6,idx << ": " << w(idx));
+                DEBUG_OUT(6,idx << ": " << weights[idx]);
             }
         }
         {
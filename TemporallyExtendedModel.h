@@ -4,6 +4,10 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <memory>
 
 #include <lbfgs.h>
 
@@ -12,6 +16,12 @@
 #endif
 #include <armadillo>
 
+#include "FMatrixStore.h"
+#include "FeatureSet.h"
+#include "TruthTable.h"
+
+class TrajectoryFile;
+
 /**
  * Learn a feature set and predictive Conditional Random Field model.
  *
@@ -159,11 +169,36 @@
  * where \f$\widetilde{\mathbf{F}}\f$ is computed from the new
  * features and \f$\mathtt{explin}\f$ and \f$\mathtt{z}\f$ are computed from
  * the old features.
+ *
+ * This is used to score candidate features in expand_feature_set(): The
+ * normalized \f$\mathtt{explin}/\mathtt{z}\f$ of the current model are cached
+ * for every data point (outcome_probabilities) and only candidates with a
+ * large enough partial derivative are admitted to the feature set (see
+ * set_candidate_threshold() and set_max_candidates()). Under L1
+ * regularization a zero-weight feature stays at zero as long as the absolute
+ * value of its partial derivative is below the regularization, so
+ * set_candidate_threshold(regularization) is a natural choice.
+ * Alternatively, candidates can be ranked by their support, that is, the
+ * fraction of data points they are true for (see set_admission_score()).
+ * With an admission policy, candidates are generated and admitted in blocks
+ * so that the number of candidates held at any time is bounded.
  */
 class TemporallyExtendedModel {
 
     // for unit tests
     friend class TemporallyExtendedModelTest_FeatureTest_Test;
+    friend class TemporallyExtendedModelTest_CandidateGradients_Test;
+    friend class TemporallyExtendedModelTest_SupportAdmission_Test;
+    friend class TemporallyExtendedModelTest_MinSupport_Test;
+    friend class TemporallyExtendedModelTest_RegularizationPath_Test;
+    friend class TemporallyExtendedModelTest_LargeWeights_Test;
+    friend class TemporallyExtendedModelTest_LineSearch_Test;
+    friend class TemporallyExtendedModelTest_OutcomeIndependentFeatures_Test;
+    friend class TemporallyExtendedModelTest_ContextPacking_Test;
+    friend class TemporallyExtendedModelTest_IncrementalFMatrices_Test;
+    friend class TemporallyExtendedModelTest_CandidateBlocks_Test;
+    // compiled model
+    friend class Predictor;
 
     //----typdefs/classes----//
 public:
@@ -178,13 +213,76 @@ public:
         reward_t reward;
     };
     typedef std::vector<DataPoint> data_t;
-    enum FEATURE_TYPE { ACTION, OBSERVATION, REWARD };
-    typedef std::tuple<FEATURE_TYPE,int,double> basis_feature_t;
-    typedef std::set<basis_feature_t> feature_t;
-    typedef std::map<feature_t,double> feature_set_t;
+    /**
+     * Read-only view of data points that are either contiguous (e.g. in a
+     * data_t) or stored in separate columns (e.g. of a memory-mapped
+     * TrajectoryFile), which are read in place. The view may share ownership
+     * of the underlying storage so that copies remain valid. */
+    class DataView {
+    public:
+        DataView() = default;
+        DataView(const data_t & data, std::shared_ptr<const void> owner = nullptr):
+            points(data.data()), n(data.size()), owner(owner) {}
+        DataView(const std::int32_t * actions,
+                 const std::int32_t * observations,
+                 const double * rewards,
+                 std::size_t n,
+                 std::shared_ptr<const void> owner = nullptr):
+            actions(actions), observations(observations), rewards(rewards), n(n), owner(owner) {}
+        std::size_t size() const {return n;}
+        bool empty() const {return n==0;}
+        DataPoint operator[](std::size_t idx) const {
+            return points!=nullptr ? points[idx] : DataPoint(actions[idx],observations[idx],rewards[idx]);
+        }
+    private:
+        const DataPoint * points = nullptr;
+        const std::int32_t * actions = nullptr;
+        const std::int32_t * observations = nullptr;
+        const double * rewards = nullptr;
+        std::size_t n = 0;
+        std::shared_ptr<const void> owner;
+    };
+    /** Methods for optimizing the feature weights. */
+    enum OPTIMIZER {
+        LBFGS,  ///< Full-batch (orthant-wise) L-BFGS
+        SGD,    ///< Mini-batch stochastic gradient descent
+        ADAM    ///< Mini-batch Adam
+    };
+    /** Scores for ranking candidate features (see admit_candidates()). */
+    enum ADMISSION_SCORE {
+        GRADIENT,   ///< Absolute partial derivative of the objective
+        SUPPORT     ///< Fraction of data points the feature is true for
+    };
+    typedef FeatureSet::FEATURE_TYPE FEATURE_TYPE;
+    static const FEATURE_TYPE ACTION = FeatureSet::ACTION;
+    static const FEATURE_TYPE OBSERVATION = FeatureSet::OBSERVATION;
+    static const FEATURE_TYPE REWARD = FeatureSet::REWARD;
+    typedef FeatureSet::basis_feature_t basis_feature_t;
+    typedef FeatureSet feature_set_t;
     typedef arma::Mat<double> mat_t;
     typedef arma::Col<double> col_vec_t;
     typedef arma::Row<double> row_vec_t;
+    /**
+     * Features prepared for evaluation via basis_truth. For feature i the
+     * basis features that depend on the history (columns of basis_truth) are
+     * basis[basis_ptr[i]...basis_ptr[i+1]-1] and the outcomes (columns of the
+     * F-matrix) for which the remaining basis features are true are
+     * outcomes[outcome_ptr[i]...outcome_ptr[i+1]-1]. */
+    struct FeaturePlan {
+        std::vector<std::size_t> basis_ptr, outcome_ptr;
+        std::vector<int> basis, outcomes;
+    };
+    /**
+     * Linear terms (outcomes × contexts) of the objective for given weights
+     * (see neg_log_likelihood()). */
+    struct LinearTerms {
+        std::vector<double> weights;
+        mat_t lin;
+    };
+    /** Reusable buffers for fill_F_matrices(). */
+    struct FillBuffers {
+        std::vector<std::vector<int>> active_features, outcome_features;
+    };
 
     //----members----//
 protected:
@@ -198,21 +296,121 @@ protected:
                                         ///(default 1e-5)
     double parameter_threshold = 1e-5;  ///< Not used so far!
     int max_inner_loop_iterations = 0;  ///< Maximum number of iterations for
-                                        ///weight optimization (0 for infinite)
+                                        ///weight optimization (0 for
+                                        ///infinite; epochs for stochastic
+                                        ///optimizers)
     int max_outer_loop_iterations = 0;  ///< Maximum number of iterations for
                                         ///feature set expansion (0 for
                                         ///infinite)
     double likelihood_threshold = 0;    ///< Threshold on (f-f')/f as stopping
                                         ///criterion for inner and outer loop
                                         ///(separately)
+    double candidate_threshold = -1;    ///< Only admit candidate features with
+                                        ///a score above this threshold
+                                        ///(negative to admit all)
+    int max_candidates = 0;             ///< Maximum number of candidate
+                                        ///features admitted per expansion (0
+                                        ///for infinite)
+    int min_support = 1;                ///< Remove candidate features that
+                                        ///are active (non-zero in the
+                                        ///F-matrix) for fewer data points
+    ADMISSION_SCORE admission_score = GRADIENT; ///< Score for ranking
+                                                ///candidate features
+    int candidate_block_size = 1<<16;   ///< Maximum number of candidates
+                                        ///(pairs of a feature and a basis
+                                        ///feature) generated at once with an
+                                        ///admission policy
+    OPTIMIZER optimizer = LBFGS;        ///< Method for weight optimization
+    int batch_size = 1024;              ///< Number of data points per
+                                        ///mini-batch for stochastic
+                                        ///optimizers (rounded up to a
+                                        ///multiple of 64)
+    double learning_rate = 0.01;        ///< Step size of stochastic
+                                        ///optimizers
+    std::string F_matrix_file;          ///< File for memory-mapped
+                                        ///F-matrices (empty to keep them
+                                        ///in memory)
+    bool observed_outcomes = false;     ///< Only use (observation, reward)
+                                        ///pairs that occur in the data as
+                                        ///outcomes (instead of all
+                                        ///combinations)
+    bool outcome_slot = false;          ///< Add an outcome that stands for
+                                        ///all other (unseen) pairs
     // other stuff
-    data_t data;
+    DataView data;                      ///< Training data (owned by the view
+                                        ///or read in place from a
+                                        ///TrajectoryFile)
+    std::vector<int> episode_begins;    ///< Index of the first data point of
+                                        ///every episode in data
     std::set<int> unique_actions;
     std::set<int> unique_observations;
     std::set<double> unique_rewards;
+    std::vector<observation_t> outcome_observations; ///< Observation and
+    std::vector<reward_t> outcome_rewards;           ///<reward of every
+                                                     ///outcome (F-matrix
+                                                     ///column) in ascending
+                                                     ///order (without the
+                                                     ///outcome slot, which
+                                                     ///comes last)
     feature_set_t feature_set;
     std::vector<int> outcome_indices;
-    std::vector<mat_t> F_matrices;
+    TruthTable basis_truth;             ///< Truth values of basis features
+                                        ///depending on the history (see
+                                        ///update_basis_truth())
+    FMatrixStore F_matrices;
+    std::vector<FeatureSet::id_t> F_matrix_feature_ids; ///< Ids of features
+                                                        ///corresponding to
+                                                        ///the rows of
+                                                        ///F_matrices
+    // Data points with identical F-matrices (contexts) are collapsed so that
+    // the objective and gradient only have to be evaluated once per context
+    // (see update_contexts())
+    std::vector<int> data_context;      ///< Context of every data point
+    std::vector<int> context_data;      ///< First data point of every context
+                                        ///(representing its F-matrix)
+    std::vector<std::size_t> context_ptr; ///< Outcomes of context i in
+                                        ///[context_ptr[i],context_ptr[i+1])
+                                        ///of context_outcomes
+    std::vector<int> context_outcomes;  ///< Outcomes observed in a context
+    std::vector<double> context_counts; ///< How often these outcomes were
+                                        ///observed
+    std::vector<double> context_sizes;  ///< Number of data points of every
+                                        ///context
+    FMatrixStore context_F_store;       ///< F-matrices of all contexts
+                                        ///(empty unless there are at least
+                                        ///two data points per context and
+                                        ///F_matrices is not mapped, see
+                                        ///context_F_matrices()); costs one
+                                        ///F-matrix per context
+    mat_t chunk_gradients;              ///< Per-thread gradient buffers of
+                                        ///neg_log_likelihood()
+    mat_t chunk_scratch;                ///< Per-thread buffers for linear
+                                        ///terms of a block of contexts in
+                                        ///neg_log_likelihood()
+    std::vector<double> chunk_objectives; ///< Per-thread objective values
+                                          ///of neg_log_likelihood()
+    // Linear terms of recent evaluations of neg_log_likelihood() for
+    // interpolating them during line searches. These are three
+    // outcomes×contexts matrices (plus three weight vectors), that is,
+    // 24·outcomes·contexts bytes.
+    LinearTerms current_lin;            ///< Current evaluation
+    LinearTerms line_lin[2];            ///< Two points on the current search
+                                        ///line
+    bool line_valid = false;            ///< Whether line_lin is valid
+    int last_lin_idx = -1;              ///< Last evaluation in line_lin[0],
+                                        ///line_lin[1], or current_lin (0, 1,
+                                        ///2; -1 if invalid)
+    mat_t outcome_probabilities;        ///< Predictive distribution (columns)
+                                        ///of the current model for all data
+                                        ///points (empty if outdated)
+    // Result of the last (converged) L-BFGS optimization. If the features
+    // with non-zero weight and their weights did not change since then, the
+    // weights are still optimal and optimize_weights() returns early.
+    std::vector<FeatureSet::id_t> optimum_feature_ids; ///< Feature ids (empty
+                                                       ///if outdated)
+    std::vector<double> optimum_weights;               ///< Weights
+    double optimum_regularization = 0;                 ///< Regularization
+    double optimum_objective = 0;                      ///< Objective value
 
     //----methods----//
 public:
@@ -220,30 +418,256 @@ public:
     virtual ~TemporallyExtendedModel() = default;
     virtual TemporallyExtendedModel & set_regularization(double d) {regularization=d;return *this;}
     virtual TemporallyExtendedModel & set_data(const data_t &);
+    /**
+     * Use independent episodes as data (histories do not reach across
+     * episode boundaries). */
+    virtual TemporallyExtendedModel & set_data(const std::vector<data_t> & episodes);
+    /**
+     * Use all data points (and episodes) of a (memory-mapped) trajectory file
+     * as data. The columns are read in place (not copied) and the model keeps
+     * the mapping alive, even if the file is closed. */
+    virtual TemporallyExtendedModel & set_data(const TrajectoryFile &);
     virtual TemporallyExtendedModel & set_horizon_extension(int n) {horizon_extension=n;return *this;}
     virtual TemporallyExtendedModel & set_maximum_horizon(int n) {maximum_horizon=n;return *this;}
     virtual double optimize();
+    /**
+     * Optimize for a sequence of regularizations from strong to weak.
+     *
+     * The feature set is learned once with optimize() for the weakest
+     * regularization. The weights are then re-optimized on this feature set
+     * (which is not shrunk) for the regularizations in decreasing order, each
+     * continuing from the previous weights, so that the result for a given
+     * regularization only depends on the weakest one (up to the optimizer's
+     * tolerance). A single point gives the same result as optimize(). After
+     * each optimization the given callback (if any) is called with the
+     * model, e.g., to save() it or to construct a Predictor. Returns the
+     * likelihood for each regularization (in the order they were given). The
+     * model keeps the weakest regularization. */
+    virtual std::vector<double> optimize_path(const std::vector<double> & regularizations,
+                                              std::function<void(const TemporallyExtendedModel &)> callback = nullptr);
     virtual double get_prediction(const data_t & data) const;
+    /**
+     * Predictive distributions for all data points of the given data, computed
+     * in parallel (one column per data point, rows correspond to the outcomes
+     * of the training data in the order of the F-matrix columns, see
+     * outcome_observation() and outcome_reward()). */
+    mat_t get_predictions(const data_t & data) const;
+    /** Predictive distributions for independent episodes (concatenated). */
+    mat_t get_predictions(const std::vector<data_t> & episodes) const;
+    /**
+     * Log-probabilities of the actual outcomes of all data points of the given
+     * data, computed in parallel (-inf for outcomes that did not occur in the
+     * training data unless there is an outcome slot). */
+    col_vec_t get_log_likelihoods(const data_t & data) const;
+    /** Log-probabilities for independent episodes (concatenated). */
+    col_vec_t get_log_likelihoods(const std::vector<data_t> & episodes) const;
     virtual TemporallyExtendedModel & set_gradient_threshold(double d) {gradient_threshold=d;return *this;}
     virtual TemporallyExtendedModel & set_parameter_threshold(double d) {parameter_threshold=d;return *this;}
+    /**
+     * Maximum number of iterations for weight optimization (0 for
+     * infinite). For the stochastic optimizers (see set_optimizer()) this is
+     * the number of epochs: with a positive value exactly that many epochs
+     * are run, otherwise epochs are run until the (regularized) objective of
+     * an epoch improves by no more than the likelihood threshold (see
+     * set_likelihood_threshold()). */
     virtual TemporallyExtendedModel & set_max_inner_loop_iterations(int n) {max_inner_loop_iterations=n;return *this;}
     virtual TemporallyExtendedModel & set_max_outer_loop_iterations(int n) {max_outer_loop_iterations=n;return *this;}
     virtual TemporallyExtendedModel & set_likelihood_threshold(double d) {likelihood_threshold=d;return *this;}
+    virtual TemporallyExtendedModel & set_candidate_threshold(double d) {candidate_threshold=d;return *this;}
+    virtual TemporallyExtendedModel & set_max_candidates(int n) {max_candidates=n;return *this;}
+    virtual TemporallyExtendedModel & set_admission_score(ADMISSION_SCORE a) {admission_score=a;return *this;}
+    virtual TemporallyExtendedModel & set_min_support(int n) {min_support=n;return *this;}
+    virtual TemporallyExtendedModel & set_optimizer(OPTIMIZER o) {optimizer=o;return *this;}
+    virtual TemporallyExtendedModel & set_batch_size(int n) {batch_size=n;return *this;}
+    virtual TemporallyExtendedModel & set_learning_rate(double d) {learning_rate=d;return *this;}
+    /**
+     * Keep the F-matrices in the given file and memory-map it instead of
+     * holding them in memory (empty string to disable). If the file already
+     * contains the F-matrices for the current data and feature set (e.g. from
+     * a previous run with a different regularization) they are used without
+     * recomputing them. Otherwise they are written to the file while being
+     * computed so that each thread only holds the F-matrices of one truth
+     * table word (64 data points) in memory. */
+    virtual TemporallyExtendedModel & set_F_matrix_file(const std::string & s) {F_matrix_file=s;return *this;}
+    /**
+     * Use only the (observation, reward) pairs that occur in the data as
+     * outcomes instead of all combinations of observations and rewards.
+     * Optionally, add one more outcome (the outcome slot) that stands for all
+     * other pairs. Features referring to the outcome are never true for the
+     * slot, which therefore keeps some probability for unseen outcomes. */
+    virtual TemporallyExtendedModel & set_observed_outcomes(bool observed, bool slot = false);
+    /** Number of outcomes (F-matrix columns, including the outcome slot). */
+    int outcome_number() const {return outcome_observations.size()+(outcome_slot?1:0);}
+    /** Observation of given outcome (not defined for the outcome slot). */
+    observation_t outcome_observation(int outcome_idx) const {return outcome_observations[outcome_idx];}
+    /** Reward of given outcome (not defined for the outcome slot). */
+    reward_t outcome_reward(int outcome_idx) const {return outcome_rewards[outcome_idx];}
+    /** Whether the last outcome is the outcome slot. */
+    bool has_outcome_slot() const {return outcome_slot;}
+    /**
+     * Optimize the weights of the current feature set with the selected
+     * optimizer (see set_optimizer()) and return the likelihood. */
     double optimize_weights();
     const feature_set_t & get_feature_set() const {return feature_set;}
     bool check_derivatives();
     void expand_feature_set();
     void shrink_feature_set();
     void print_feature_set();
+    /**
+     * Write the model (horizon settings, outcome tables, basis features,
+     * features, and weights) to a binary file. Returns false on failure. */
+    bool save(const std::string & file_name) const;
+    /**
+     * Replace the model by the one in the given file (see save()). Data
+     * (and anything computed from it) is discarded. Files written by older
+     * versions remain readable. Returns false (leaving the model unchanged)
+     * if the file cannot be read. */
+    bool load(const std::string & file_name);
 protected:
+    /**
+     * Compute the unique values in data (in parallel) and reset everything
+     * computed from the previous data. */
+    void update_data();
+    /**
+     * Optimize weights with mini-batch SGD or Adam (see optimize_weights()).
+     * The F-matrices of each mini-batch are computed on the fly from
+     * basis_truth so F_matrices are neither used nor updated. */
+    double optimize_weights_stochastic();
+    /**
+     * Negative log-likelihood (mean over the data points of the given words
+     * of basis_truth) and its gradient (if not null) with the F-matrices
+     * computed on the fly. If store_probabilities is true the predictions of
+     * these data points are written to outcome_probabilities. */
+    double streamed_neg_log_likelihood(const FeaturePlan & plan,
+                                       const std::vector<int> & words,
+                                       const double * weights,
+                                       double * gradient,
+                                       bool store_probabilities);
     void update_F_matrices();
+    /**
+     * Collapse data points with identical F-matrices into contexts with
+     * counts of the observed outcomes (requires up-to-date F_matrices and
+     * outcome_indices). */
+    void update_contexts();
+    /**
+     * Hash of the data (including episode boundaries), outcomes, and feature
+     * set identifying the F-matrices. */
+    std::uint64_t F_matrix_signature() const;
+    /** Recompute outcome_probabilities (requires up-to-date F_matrices). */
+    void update_outcome_probabilities();
+    /**
+     * Compute the partial derivatives of neg_log_likelihood() with respect to
+     * the given (zero-weight) candidate features using outcome_probabilities
+     * of the current model. */
+    void candidate_gradients(const std::vector<int> & candidates,
+                             std::vector<double> & gradient);
+    /**
+     * Compute the fraction of data points for which the given candidate
+     * features are true (with the observed outcome) via basis_truth (requires
+     * up-to-date outcome_indices). */
+    void candidate_support(const std::vector<int> & candidates,
+                           std::vector<double> & support);
+    /**
+     * Count the data points for which the given candidate features are
+     * active (all basis features referring to the history are true) or, if
+     * observed_outcome is true, are true with the observed outcome (requires
+     * up-to-date outcome_indices). */
+    void support_counts(const std::vector<int> & candidates,
+                        bool observed_outcome,
+                        std::vector<long> & counts);
+    /**
+     * Remove all candidates (features with index old_feature_n and above)
+     * that are active for fewer than min_support data points. */
+    void prune_candidates(int old_feature_n);
+    /**
+     * Remove all candidates (features with index old_feature_n and above)
+     * that do not pass the admission criteria (score above
+     * candidate_threshold and among the max_candidates best). Only the
+     * candidates from new_begin on are scored, those before were admitted
+     * before with the given scores (which are updated to those of the
+     * admitted candidates). */
+    void admit_candidates(int old_feature_n,
+                          int new_begin,
+                          std::vector<double> & admitted_scores);
+    /**
+     * Evaluate all basis features not yet contained in basis_truth on all
+     * data points. Basis features that refer to the outcome (observation or
+     * reward at time 0) are not evaluated and get a zero column. */
+    void update_basis_truth();
+    /**
+     * Evaluate the given basis feature on all data points of the given
+     * episodes (starting at the given indices of data) and set the true ones
+     * in the given column of truth. Basis features referring to data points
+     * before the beginning of the episode are false. */
+    void evaluate_basis_feature(int basis_idx,
+                                const DataView & data,
+                                const std::vector<int> & episode_begins,
+                                TruthTable & truth,
+                                int col) const;
+    /** Prepare the given features for evaluation with fill_F_matrices(). */
+    void plan_features(const std::vector<int> & features, FeaturePlan & plan) const;
+    /**
+     * Append the F-matrices of the (up to 64) data points of the given word of
+     * truth (usually basis_truth) to F_matrices. Rows correspond to the
+     * planned features and plan.basis refers to columns of truth. */
+    void fill_F_matrices(const FeaturePlan & plan,
+                         const TruthTable & truth,
+                         int word_idx,
+                         FMatrixStore & F_matrices,
+                         FillBuffers & buffers) const;
+    /**
+     * Compute predictive distributions (outcome_n values per data point)
+     * and/or log-probabilities of the actual outcomes (one per data point)
+     * for all data points of the given episodes (starting at the given
+     * indices of data). Either pointer may be null. */
+    void batch_predict(const data_t & data,
+                       const std::vector<int> & episode_begins,
+                       double * distributions,
+                       double * log_likelihoods) const;
+    /**
+     * Replace the linear terms lin[0...n-1] by their softmax and return the
+     * log-normalization log(sum(exp(lin))) (subtracting the maximum for
+     * numerical stability). Used for all predictive distributions. */
+    static double softmax(double * lin, int n);
+    /**
+     * F-matrices of all contexts (one per context and in the same order) or
+     * null if they are not adjacent in any store (see context_F_matrix()). */
+    const FMatrixStore * context_F_matrices() const {
+        if(context_F_store.size()==(int)context_data.size()) return &context_F_store;
+        if(F_matrices.size()==(int)context_data.size()) return &F_matrices;
+        return nullptr;
+    }
+    /** F-matrix of the given context. */
+    FMatrixStore::Matrix context_F_matrix(int context_idx) const {
+        const FMatrixStore * store = context_F_matrices();
+        return store!=nullptr ? (*store)[context_idx] : F_matrices[context_data[context_idx]];
+    }
+    /**
+     * Rebuild the outcome tables (outcome_observations and outcome_rewards)
+     * from the unique observations and rewards or the data, which invalidates
+     * everything that refers to outcomes. */
+    void update_outcomes();
+    /** Recompute outcome_indices for all data points. */
+    void update_outcome_indices();
+    /**
+     * Whether the current weights are still those of the last converged
+     * optimization (see optimum_feature_ids). */
+    bool weights_at_optimum() const;
+    /**
+     * Index of the outcome (F-matrix column) of the given data point (the
+     * outcome slot or -1 if it is not in the outcome tables). */
+    int outcome_index(const DataPoint & point) const;
+    /**
+     * Append the F-matrix of the given data point to F_matrices using the
+     * given features (in that order) as rows. */
     static void fill_F_matrix(const feature_set_t & feature_set,
-                              const std::set<int> & unique_actions,
-                              const std::set<int> & unique_observations,
-                              const std::set<double> & unique_rewards,
-                              const data_t & data,
+                              const std::vector<int> & features,
+                              const std::vector<observation_t> & outcome_observations,
+                              const std::vector<reward_t> & outcome_rewards,
+                              bool outcome_slot,
+                              const DataView & data,
                               const int & data_idx,
-                              mat_t & F_matrix,
+                              FMatrixStore & F_matrices,
                               int & outcome_index);
     static lbfgsfloatval_t neg_log_likelihood(void * instance,
                                               const lbfgsfloatval_t * weights,
@@ -0,0 +1,150 @@
+#include "TrajectoryFile.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEBUG_STRING "TrajectoryFile: "
+#define DEBUG_LEVEL 0
+#include "debug.h"
+
+using std::vector;
+
+// file header (followed by episode begins, actions, observations, and
+// rewards, each as a contiguous column)
+namespace {
+    struct FileHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t reserved;
+        std::uint64_t data_n, episode_n;
+    };
+    const char file_magic[8] = {'A','T','E','M','T','R','A','J'};
+    const std::uint32_t file_version = 1;
+    // offset of the reward column (keeping it aligned)
+    std::size_t reward_offset(std::uint64_t data_n, std::uint64_t episode_n) {
+        std::size_t offset = sizeof(FileHeader)+episode_n*sizeof(std::uint64_t)+2*data_n*sizeof(std::int32_t);
+        return (offset+sizeof(double)-1)/sizeof(double)*sizeof(double);
+    }
+}
+
+bool TrajectoryFile::write(const std::string & file_name, const data_t & data) {
+    return write(file_name,vector<data_t>(1,data));
+}
+
+bool TrajectoryFile::write(const std::string & file_name, const vector<data_t> & episodes) {
+    FileHeader header;
+    std::memcpy(header.magic,file_magic,sizeof(file_magic));
+    header.version = file_version;
+    header.reserved = 0;
+    header.data_n = 0;
+    header.episode_n = episodes.size();
+    vector<std::uint64_t> begins;
+    for(auto & episode : episodes) {
+        begins.push_back(header.data_n);
+        header.data_n += episode.size();
+    }
+    FILE * file = fopen(file_name.c_str(),"wb");
+    if(file==nullptr) {
+        DEBUG_WARNING("Could not open '" << file_name << "' for writing");
+        return false;
+    }
+    bool ok = fwrite(&header,sizeof(header),1,file)==1 &&
+        fwrite(begins.data(),sizeof(std::uint64_t),begins.size(),file)==begins.size();
+    // columns
+    vector<std::int32_t> int_column;
+    for(auto & episode : episodes) {
+        int_column.clear();
+        for(auto & point : episode) int_column.push_back(point.action);
+        ok = ok && fwrite(int_column.data(),sizeof(std::int32_t),int_column.size(),file)==int_column.size();
+    }
+    for(auto & episode : episodes) {
+        int_column.clear();
+        for(auto & point : episode) int_column.push_back(point.observation);
+        ok = ok && fwrite(int_column.data(),sizeof(std::int32_t),int_column.size(),file)==int_column.size();
+    }
+    std::size_t padding = reward_offset(header.data_n,header.episode_n) -
+        (sizeof(FileHeader)+header.episode_n*sizeof(std::uint64_t)+2*header.data_n*sizeof(std::int32_t));
+    const char zeros[sizeof(double)] = {};
+    ok = ok && fwrite(zeros,1,padding,file)==padding;
+    vector<double> double_column;
+    for(auto & episode : episodes) {
+        double_column.clear();
+        for(auto & point : episode) double_column.push_back(point.reward);
+        ok = ok && fwrite(double_column.data(),sizeof(double),double_column.size(),file)==double_column.size();
+    }
+    ok = fclose(file)==0 && ok;
+    if(!ok) {
+        DEBUG_WARNING("Could not write '" << file_name << "'");
+    }
+    return ok;
+}
+
+bool TrajectoryFile::open(const std::string & file_name) {
+    close();
+    int fd = ::open(file_name.c_str(),O_RDONLY);
+    if(fd<0) {
+        DEBUG_WARNING("Could not open '" << file_name << "'");
+        return false;
+    }
+    struct stat file_stat;
+    if(fstat(fd,&file_stat)!=0 || (std::size_t)file_stat.st_size<sizeof(FileHeader)) {
+        ::close(fd);
+        return false;
+    }
+    std::size_t length = file_stat.st_size;
+    void * address = mmap(nullptr,length,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(address==MAP_FAILED) return false;
+    std::shared_ptr<const char> new_mapping((const char*)address,
+                                            [length](const char * ptr){munmap((void*)ptr,length);});
+    // check header
+    FileHeader header;
+    std::memcpy(&header,address,sizeof(header));
+    if(std::memcmp(header.magic,file_magic,sizeof(file_magic))!=0 ||
+       header.version<1 || header.version>file_version ||
+       header.episode_n>length/sizeof(std::uint64_t) ||
+       header.data_n>length/sizeof(double) ||
+       length!=reward_offset(header.data_n,header.episode_n)+header.data_n*sizeof(double)) {
+        DEBUG_WARNING("'" << file_name << "' is not a valid trajectory file");
+        return false;
+    }
+    // set columns
+    const char * ptr = new_mapping.get()+sizeof(header);
+    episode_begins = (const std::uint64_t*)ptr;
+    ptr += header.episode_n*sizeof(std::uint64_t);
+    action_column = (const std::int32_t*)ptr;
+    ptr += header.data_n*sizeof(std::int32_t);
+    observation_column = (const std::int32_t*)ptr;
+    reward_column = (const double*)(new_mapping.get()+reward_offset(header.data_n,header.episode_n));
+    for(std::uint64_t episode_idx=0; episode_idx<header.episode_n; ++episode_idx) {
+        if(episode_begins[episode_idx]>header.data_n ||
+           (episode_idx==0 && episode_begins[episode_idx]!=0) ||
+           (episode_idx>0 && episode_begins[episode_idx]<episode_begins[episode_idx-1])) {
+            DEBUG_WARNING("'" << file_name << "' has invalid episode boundaries");
+            episode_begins = nullptr;
+            action_column = nullptr;
+            observation_column = nullptr;
+            reward_column = nullptr;
+            return false;
+        }
+    }
+    data_n = header.data_n;
+    episode_n = header.episode_n;
+    mapping = new_mapping;
+    return true;
+}
+
+void TrajectoryFile::close() {
+    mapping.reset();
+    data_n = 0;
+    episode_n = 0;
+    episode_begins = nullptr;
+    action_column = nullptr;
+    observation_column = nullptr;
+    reward_column = nullptr;
+}
@@ -0,0 +1,81 @@
+#ifndef TRAJECTORY_FILE_H_
+#define TRAJECTORY_FILE_H_
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "TemporallyExtendedModel.h"
+
+/**
+ * Columnar binary file of trajectories (data points of one or more
+ * episodes).
+ *
+ * Actions, observations, and rewards are stored in separate contiguous
+ * columns, preceded by a header and the index of the first data point of
+ * every episode. Files are written with write() and memory-mapped with
+ * open() so that the columns can be read in place without parsing or
+ * copying. A TrajectoryFile can be passed to
+ * TemporallyExtendedModel::set_data(), which reads the columns in place via
+ * view() (without copying them). Copies share the same mapping.
+ */
+class TrajectoryFile {
+
+    //----typdefs/classes----//
+public:
+    typedef TemporallyExtendedModel::action_t action_t;
+    typedef TemporallyExtendedModel::observation_t observation_t;
+    typedef TemporallyExtendedModel::reward_t reward_t;
+    typedef TemporallyExtendedModel::DataPoint DataPoint;
+    typedef TemporallyExtendedModel::data_t data_t;
+
+    //----members----//
+protected:
+    std::shared_ptr<const char> mapping;        ///< Mapped file (null if no
+                                                ///file is open)
+    std::size_t data_n = 0;                     ///< Number of data points
+    std::size_t episode_n = 0;                  ///< Number of episodes
+    const std::uint64_t * episode_begins = nullptr; ///< First data point of
+                                                    ///every episode
+    const std::int32_t * action_column = nullptr;
+    const std::int32_t * observation_column = nullptr;
+    const double * reward_column = nullptr;
+
+    //----methods----//
+public:
+    TrajectoryFile() = default;
+    virtual ~TrajectoryFile() = default;
+    /** Write data as a single episode. Returns false on failure. */
+    static bool write(const std::string & file_name, const data_t & data);
+    /** Write episodes (one after the other). Returns false on failure. */
+    static bool write(const std::string & file_name, const std::vector<data_t> & episodes);
+    /** Map the given file. Returns false (and closes) on failure. */
+    bool open(const std::string & file_name);
+    void close();
+    bool is_open() const {return (bool)mapping;}
+    /** Number of data points (in all episodes). */
+    std::size_t size() const {return data_n;}
+    std::size_t episode_number() const {return episode_n;}
+    /** Index of the first data point of given episode. */
+    std::size_t episode_begin(std::size_t episode_idx) const {return episode_begins[episode_idx];}
+    /** Index one past the last data point of given episode. */
+    std::size_t episode_end(std::size_t episode_idx) const {
+        return episode_idx+1<episode_n ? episode_begins[episode_idx+1] : data_n;
+    }
+    const std::int32_t * actions() const {return action_column;}
+    const std::int32_t * observations() const {return observation_column;}
+    const double * rewards() const {return reward_column;}
+    /**
+     * View of all data points that reads the mapped columns in place (and
+     * keeps the mapping alive). */
+    TemporallyExtendedModel::DataView view() const {
+        return TemporallyExtendedModel::DataView(action_column,observation_column,reward_column,data_n,mapping);
+    }
+    DataPoint operator[](std::size_t data_idx) const {
+        return DataPoint(action_column[data_idx],observation_column[data_idx],reward_column[data_idx]);
+    }
+};
+
+#endif /* TRAJECTORY_FILE_H_ */
@@ -0,0 +1,23 @@
+#include "TruthTable.h"
+
+typedef TruthTable::word_t word_t;
+
+const int TruthTable::word_bits;
+
+void TruthTable::reset(int data_number) {
+    data_n = data_number;
+    word_n = (data_n+word_bits-1)/word_bits;
+    col_n = 0;
+    words.clear();
+}
+
+int TruthTable::add_column() {
+    words.resize(words.size()+word_n,0);
+    return col_n++;
+}
+
+word_t TruthTable::valid_bits(int word_idx) const {
+    int bit_n = data_n-word_idx*word_bits;
+    if(bit_n>=word_bits) return ~word_t(0);
+    return (word_t(1)<<bit_n)-1;
+}
@@ -0,0 +1,49 @@
+#ifndef TRUTH_TABLE_H_
+#define TRUTH_TABLE_H_
+
+#include <vector>
+#include <cstdint>
+
+/**
+ * Bit columns indicating for which data points some conditions (usually
+ * basis features) are true.
+ *
+ * Data points are packed into 64-bit words so that conjunctions of conditions
+ * can be evaluated for 64 data points at once using bitwise AND. Bits beyond
+ * the last data point are always zero.
+ */
+class TruthTable {
+
+    //----typdefs/classes----//
+public:
+    typedef std::uint64_t word_t;
+    static const int word_bits = 64;
+
+    //----members----//
+protected:
+    int data_n = 0;                     ///< Number of data points (bits per
+                                        ///column)
+    int word_n = 0;                     ///< Number of words per column
+    int col_n = 0;                      ///< Number of columns
+    std::vector<word_t> words;          ///< Columns (one after the other)
+
+    //----methods----//
+public:
+    TruthTable() = default;
+    virtual ~TruthTable() = default;
+    /** Remove all columns and set the number of data points. */
+    void reset(int data_number);
+    /** Append a column with all bits set to zero and return its index. */
+    int add_column();
+    int column_number() const {return col_n;}
+    int data_number() const {return data_n;}
+    int word_number() const {return word_n;}
+    word_t * column(int col) {return words.data()+(std::size_t)col*word_n;}
+    const word_t * column(int col) const {return words.data()+(std::size_t)col*word_n;}
+    void set(int col, int data_idx) {column(col)[data_idx/word_bits] |= word_t(1)<<(data_idx%word_bits);}
+    bool get(int col, int data_idx) const {return (column(col)[data_idx/word_bits]>>(data_idx%word_bits))&1;}
+    /** Word with the bits of all existing data points in given word set. */
+    word_t valid_bits(int word_idx) const;
+};
+
+#endif /* TRUTH_TABLE_H_ */
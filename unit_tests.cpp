@@ -2,8 +2,14 @@
 
 #include <memory> // std::shared_ptr
 #include <limits>
+#include <numeric> // std::iota
+#include <type_traits>
+#include <omp.h>
 
 #include "TemporallyExtendedModel.h"
+#include "Predictor.h"
+#include "StreamingPredictor.h"
+#include "TrajectoryFile.h"
 
 #define DEBUG_STRING "Unit Tests: "
 #define DEBUG_LEVEL 0
@@ -159,12 +165,12 @@ TEST_F(TemporallyExtendedModelTest, FeatureTest) {
             DEBUG_OUT(2,"data point " << data_idx << ":	" << data[data_idx].action << "	" << data[data_idx].observation << "	" << data[data_idx].reward);
         }
         DEBUG_INDENT;
-        int feature_idx = 0;
-        for(auto & feature : TEM.feature_set) {
+        for(int feature_idx=0; feature_idx<TEM.feature_set.size(); ++feature_idx) {
             DEBUG_OUT(3,"Feature " << feature_idx);
             DEBUG_INDENT;
             bool is_true = true;
-            for(auto & basis_feature : feature.first) {
+            for(auto basis_idx : TEM.feature_set[feature_idx]) {
+                const auto & basis_feature = TEM.feature_set.basis_feature(basis_idx);
                 bool this_one_true = true;
                 typedef TemporallyExtendedModel::FEATURE_TYPE type_t;
                 type_t type;
@@ -191,7 +197,6 @@ TEST_F(TemporallyExtendedModelTest, FeatureTest) {
                 is_true = is_true && this_one_true;
             }
             EXPECT_EQ(is_true,TEM.F_matrices[data_idx](feature_idx,TEM.outcome_indices[data_idx]));
-            ++feature_idx;
         }
     }
 }
@@ -247,3 +252,868 @@ TEST_F(TemporallyExtendedModelTest, Derivatives) {
     TEM.optimize();
     EXPECT_TRUE(TEM.check_derivatives());
 }
+
+TEST_F(TemporallyExtendedModelTest, CandidateGradients) {
+    // optimize for one iteration to get non-trivial weights
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_regularization(0.001).
+        set_max_outer_loop_iterations(1);
+    TEM.optimize();
+
+    // expand a copy by all candidates and compute the full gradient
+    TemporallyExtendedModel TEM_expanded = TEM;
+    TEM_expanded.expand_feature_set();
+    TEM_expanded.update_F_matrices();
+    std::vector<double> weights = TEM_expanded.feature_set.weights();
+    std::vector<double> gradient(weights.size());
+    TemporallyExtendedModel::neg_log_likelihood(&TEM_expanded,
+                                                &(weights.front()),
+                                                &(gradient.front()),
+                                                weights.size());
+
+    // compute the gradient of the candidates (appended to the end of the
+    // expanded feature set) only
+    int old_feature_n = TEM.feature_set.size();
+    int candidate_n = TEM_expanded.feature_set.size()-old_feature_n;
+    std::vector<int> candidates;
+    for(int feature_idx=old_feature_n; feature_idx<TEM_expanded.feature_set.size(); ++feature_idx) {
+        candidates.push_back(feature_idx);
+    }
+    std::vector<double> candidate_gradient;
+    TEM_expanded.candidate_gradients(candidates,candidate_gradient);
+
+    // compare
+    ASSERT_EQ(candidate_gradient.size(),candidate_n);
+    for(int candidate_idx=0; candidate_idx<candidate_n; ++candidate_idx) {
+        EXPECT_NEAR(candidate_gradient[candidate_idx],gradient[old_feature_n+candidate_idx],1e-10);
+    }
+
+    // admitting a limited number of candidates
+    TEM.set_max_candidates(5).expand_feature_set();
+    EXPECT_EQ(TEM.feature_set.size(),old_feature_n+5);
+}
+
+TEST_F(TemporallyExtendedModelTest, Predictor) {
+    // learn
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_regularization(0.001).
+        set_horizon_extension(2).
+        set_maximum_horizon(2).
+        set_max_outer_loop_iterations(2).
+        optimize();
+
+    // compare compiled predictions to those of the model
+    Predictor predictor(TEM);
+    EXPECT_EQ(predictor.feature_number(),TEM.get_feature_set().size());
+    EXPECT_LE(predictor.history_length(),2);
+    data_t data_copy;
+    for(int data_idx=0; data_idx<100; ++data_idx) {
+        data_copy.push_back(data[data_idx]);
+        const auto & distribution = predictor.predict(data,data_idx);
+        double sum = 0;
+        for(auto p : distribution) sum += p;
+        EXPECT_NEAR(sum,1,1e-10);
+        EXPECT_NEAR(predictor.probability(data,data_idx),TEM.get_prediction(data_copy),1e-10);
+        EXPECT_NEAR(distribution[predictor.outcome_index(data[data_idx])],TEM.get_prediction(data_copy),1e-10);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, StreamingPredictor) {
+    // learn
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_regularization(0.001).
+        set_horizon_extension(2).
+        set_maximum_horizon(2).
+        set_max_outer_loop_iterations(2).
+        optimize();
+
+    // feed data points one by one and compare to predictions on full data
+    Predictor predictor(TEM);
+    StreamingPredictor streaming_predictor(TEM);
+    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
+        const auto & full = predictor.predict(data,data_idx);
+        const auto & streamed = streaming_predictor.predict(data[data_idx].action);
+        ASSERT_EQ(full.size(),streamed.size());
+        for(int outcome_idx=0; outcome_idx<(int)full.size(); ++outcome_idx) {
+            EXPECT_NEAR(full[outcome_idx],streamed[outcome_idx],1e-10);
+        }
+        streaming_predictor.add(data[data_idx]);
+    }
+
+    // after clearing the history we start from scratch
+    streaming_predictor.clear();
+    EXPECT_NEAR(streaming_predictor.probability(data[0]),predictor.probability(data,0),1e-10);
+
+    // the history-based interface of Predictor is not accessible (it would
+    // invalidate the streamed history) but the outcome queries are
+    static_assert(!std::is_convertible<StreamingPredictor*,Predictor*>::value,
+                  "StreamingPredictor must not be usable as a Predictor");
+    EXPECT_EQ(streaming_predictor.outcome_number(),predictor.outcome_number());
+    EXPECT_EQ(streaming_predictor.history_length(),predictor.history_length());
+}
+
+TEST_F(TemporallyExtendedModelTest, BatchPrediction) {
+    // learn
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_regularization(0.001).
+        set_horizon_extension(2).
+        set_maximum_horizon(2).
+        set_max_outer_loop_iterations(2).
+        optimize();
+
+    // batched predictions equal single predictions
+    Predictor predictor(TEM);
+    auto distributions = TEM.get_predictions(data);
+    auto log_likelihoods = TEM.get_log_likelihoods(data);
+    ASSERT_EQ((int)distributions.n_rows,predictor.outcome_number());
+    ASSERT_EQ(distributions.n_cols,data.size());
+    ASSERT_EQ(log_likelihoods.n_elem,data.size());
+    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
+        const auto & distribution = predictor.predict(data,data_idx);
+        for(int outcome_idx=0; outcome_idx<predictor.outcome_number(); ++outcome_idx) {
+            EXPECT_NEAR(distributions(outcome_idx,data_idx),distribution[outcome_idx],1e-10);
+        }
+        EXPECT_NEAR(exp(log_likelihoods(data_idx)),predictor.probability(data,data_idx),1e-10);
+    }
+
+    // episodes are independent and concatenated
+    int split = data.size()/3;
+    std::vector<TemporallyExtendedModel::data_t> episodes(2);
+    episodes[0].assign(data.begin(),data.begin()+split);
+    episodes[1].assign(data.begin()+split,data.end());
+    auto episode_log_likelihoods = TEM.get_log_likelihoods(episodes);
+    auto second_log_likelihoods = TEM.get_log_likelihoods(episodes[1]);
+    ASSERT_EQ(episode_log_likelihoods.n_elem,data.size());
+    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
+        if(data_idx<split) {
+            EXPECT_EQ(episode_log_likelihoods(data_idx),log_likelihoods(data_idx));
+        } else {
+            EXPECT_EQ(episode_log_likelihoods(data_idx),second_log_likelihoods(data_idx-split));
+        }
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, StochasticOptimizer) {
+    // reference: expand twice and optimize with L-BFGS
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).set_regularization(0.001);
+    TEM.expand_feature_set();
+    TEM.expand_feature_set();
+    double lbfgs_likelihood = TEM.optimize_weights();
+
+    // same feature set (starting from zero weights) optimized with mini-batch
+    // Adam and SGD comes close
+    for(auto optimizer : {TemporallyExtendedModel::ADAM, TemporallyExtendedModel::SGD}) {
+        TemporallyExtendedModel stochastic_TEM;
+        stochastic_TEM.set_data(data).
+            set_regularization(0.001).
+            set_optimizer(optimizer).
+            set_batch_size(128).
+            set_learning_rate(optimizer==TemporallyExtendedModel::ADAM?0.05:1).
+            set_max_inner_loop_iterations(50);
+        stochastic_TEM.expand_feature_set();
+        stochastic_TEM.expand_feature_set();
+        double likelihood = stochastic_TEM.optimize_weights();
+        EXPECT_GT(likelihood,0.95*lbfgs_likelihood) << "optimizer " << optimizer;
+        EXPECT_LE(likelihood,lbfgs_likelihood*1.01) << "optimizer " << optimizer;
+        // L1-regularization produces exact zeros
+        int zero_n = 0;
+        for(auto w : stochastic_TEM.get_feature_set().weights()) {
+            if(w==0) ++zero_n;
+        }
+        EXPECT_GT(zero_n,0) << "optimizer " << optimizer;
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, MappedFMatrices) {
+    std::string file_name = ::testing::TempDir()+"ATEM_F_matrices";
+    std::remove(file_name.c_str());
+    // learning with memory-mapped F-matrices gives the same result
+    double likelihood = TemporallyExtendedModel().
+        set_data(data).
+        set_regularization(0.001).
+        set_max_outer_loop_iterations(2).
+        optimize();
+    double mapped_likelihood = TemporallyExtendedModel().
+        set_data(data).
+        set_regularization(0.001).
+        set_max_outer_loop_iterations(2).
+        set_F_matrix_file(file_name).
+        optimize();
+    EXPECT_EQ(likelihood,mapped_likelihood);
+    std::remove(file_name.c_str());
+
+    // a file written for the same data points split into episodes is not
+    // used (and vice versa) since episode boundaries clip the history
+    std::vector<TemporallyExtendedModel::data_t> episodes(2);
+    episodes[0].assign(data.begin(),data.begin()+data.size()/2);
+    episodes[1].assign(data.begin()+data.size()/2,data.end());
+    auto episode_likelihood = [&](bool split, const std::string & file) {
+        TemporallyExtendedModel TEM;
+        if(split) TEM.set_data(episodes); else TEM.set_data(data);
+        TEM.set_F_matrix_file(file);
+        TEM.expand_feature_set();
+        TEM.expand_feature_set();
+        return TEM.optimize_weights();
+    };
+    double flat = episode_likelihood(false,""), split = episode_likelihood(true,"");
+    EXPECT_NE(flat,split);
+    EXPECT_EQ(episode_likelihood(true,file_name),split);
+    EXPECT_EQ(episode_likelihood(false,file_name),flat);
+    EXPECT_EQ(episode_likelihood(true,file_name),split);
+    std::remove(file_name.c_str());
+
+    // store and map F-matrices directly
+    FMatrixStore store(3,2);
+    for(int matrix_idx=0; matrix_idx<4; ++matrix_idx) {
+        for(int col=0; col<2; ++col) {
+            for(int row=0; row<3; ++row) {
+                if((row+col+matrix_idx)%2==0) store.push_back(row);
+            }
+            store.end_column();
+        }
+    }
+    ASSERT_TRUE(store.save(file_name,42));
+    FMatrixStore mapped_store;
+    EXPECT_FALSE(mapped_store.map(file_name,43));
+    EXPECT_FALSE(mapped_store.is_mapped());
+    EXPECT_FALSE(mapped_store.map(file_name,42,3,3));
+    EXPECT_FALSE(mapped_store.is_mapped());
+    ASSERT_TRUE(mapped_store.map(file_name,42,3,2));
+    EXPECT_TRUE(mapped_store.is_mapped());
+    ASSERT_EQ(mapped_store.size(),4);
+    EXPECT_EQ(mapped_store.non_zero(),store.non_zero());
+    for(int matrix_idx=0; matrix_idx<4; ++matrix_idx) {
+        for(int col=0; col<2; ++col) {
+            for(int row=0; row<3; ++row) {
+                EXPECT_EQ(mapped_store[matrix_idx](row,col),store[matrix_idx](row,col));
+            }
+        }
+    }
+    std::remove(file_name.c_str());
+
+    // write the same matrices in two segments (one matrix at a time) and
+    // concatenate them
+    std::vector<std::string> segment_names = {file_name+".0", file_name+".1"};
+    for(int segment_idx=0; segment_idx<2; ++segment_idx) {
+        FMatrixStore::SegmentWriter segment(segment_names[segment_idx]);
+        FMatrixStore segment_store(3,2);
+        for(int matrix_idx=2*segment_idx; matrix_idx<2*segment_idx+2; ++matrix_idx) {
+            for(int col=0; col<2; ++col) {
+                for(auto row_ptr=store[matrix_idx].begin(col); row_ptr!=store[matrix_idx].end(col); ++row_ptr) {
+                    segment_store.push_back(*row_ptr);
+                }
+                segment_store.end_column();
+            }
+            ASSERT_TRUE(segment.write(segment_store));
+            EXPECT_EQ(segment_store.size(),0);
+        }
+        ASSERT_TRUE(segment.close());
+    }
+    ASSERT_TRUE(FMatrixStore::concatenate(segment_names,3,2,file_name,42));
+    FMatrixStore concatenated_store;
+    ASSERT_TRUE(concatenated_store.map(file_name,42,3,2));
+    ASSERT_EQ(concatenated_store.size(),4);
+    for(int matrix_idx=0; matrix_idx<4; ++matrix_idx) {
+        EXPECT_TRUE(concatenated_store[matrix_idx]==store[matrix_idx]);
+    }
+    std::remove(file_name.c_str());
+}
+
+TEST_F(TemporallyExtendedModelTest, SaveLoad) {
+    std::string file_name = ::testing::TempDir()+"ATEM_model";
+    // learn and save
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_regularization(0.001).
+        set_horizon_extension(2).
+        set_maximum_horizon(2).
+        set_max_outer_loop_iterations(2).
+        optimize();
+    ASSERT_TRUE(TEM.save(file_name));
+
+    // loaded model makes identical predictions
+    TemporallyExtendedModel loaded_TEM;
+    ASSERT_TRUE(loaded_TEM.load(file_name));
+    ASSERT_EQ(loaded_TEM.get_feature_set().size(),TEM.get_feature_set().size());
+    Predictor predictor(TEM), loaded_predictor(loaded_TEM);
+    for(int data_idx=0; data_idx<100; ++data_idx) {
+        EXPECT_EQ(loaded_predictor.probability(data,data_idx),predictor.probability(data,data_idx));
+    }
+
+    // invalid files are rejected and leave the model unchanged
+    FILE * file = fopen(file_name.c_str(),"r+b");
+    ASSERT_NE(file,nullptr);
+    fputc('X',file);
+    fclose(file);
+    EXPECT_FALSE(loaded_TEM.load(file_name));
+    EXPECT_FALSE(loaded_TEM.load(file_name+"_does_not_exist"));
+    EXPECT_EQ(loaded_TEM.get_feature_set().size(),TEM.get_feature_set().size());
+    std::remove(file_name.c_str());
+}
+
+TEST_F(TemporallyExtendedModelTest, LoadValidation) {
+    std::string file_name = ::testing::TempDir()+"ATEM_handwritten_model";
+    // write a model file section by section (version 1 files have no
+    // outcome tables)
+    typedef TemporallyExtendedModel TEM_t;
+    std::vector<std::int32_t> basis_types = {TEM_t::OBSERVATION, TEM_t::REWARD, TEM_t::ACTION, TEM_t::OBSERVATION};
+    std::vector<std::int32_t> basis_times = {0, 0, -1, 0};
+    std::vector<double> basis_values = {0, 1, 0, 1};
+    auto write = [&](std::uint32_t version,
+                     const std::vector<std::uint64_t> & feature_ptr,
+                     const std::vector<std::int32_t> & basis_pool,
+                     const std::vector<double> & weights) {
+        FILE * file = fopen(file_name.c_str(),"wb");
+        auto array = [&](const void * values, std::size_t size, std::size_t n) {
+            fwrite(values,size,n,file);
+        };
+        auto vector = [&](const void * values, std::size_t size, std::uint64_t n) {
+            array(&n,sizeof(n),1);
+            array(values,size,n);
+        };
+        double regularization = 0.001;
+        std::int32_t horizon[2] = {1, -1};
+        std::vector<std::int32_t> actions = {0}, observations = {0, 1};
+        std::vector<double> rewards = {0, 1};
+        array("ATEMMODL",1,8);
+        array(&version,sizeof(version),1);
+        array(&regularization,sizeof(regularization),1);
+        array(horizon,sizeof(std::int32_t),2);
+        vector(actions.data(),sizeof(std::int32_t),actions.size());
+        vector(observations.data(),sizeof(std::int32_t),observations.size());
+        vector(rewards.data(),sizeof(double),rewards.size());
+        if(version>=2) {
+            std::vector<std::int32_t> observation_column = {0, 1};
+            std::vector<double> reward_column = {0, 1};
+            std::int32_t outcome_flags[2] = {true, false};
+            vector(observation_column.data(),sizeof(std::int32_t),observation_column.size());
+            vector(reward_column.data(),sizeof(double),reward_column.size());
+            array(outcome_flags,sizeof(std::int32_t),2);
+        }
+        vector(basis_types.data(),sizeof(std::int32_t),basis_types.size());
+        vector(basis_times.data(),sizeof(std::int32_t),basis_times.size());
+        vector(basis_values.data(),sizeof(double),basis_values.size());
+        vector(feature_ptr.data(),sizeof(std::uint64_t),feature_ptr.size());
+        vector(basis_pool.data(),sizeof(std::int32_t),basis_pool.size());
+        vector(weights.data(),sizeof(double),weights.size());
+        fclose(file);
+    };
+    // valid features: (obs 0), (rew 1), (action -1, obs 0)
+    std::vector<std::uint64_t> feature_ptr = {0, 1, 2, 4};
+    std::vector<double> weights = {0.5, -1, 2};
+    for(std::uint32_t version : {1, 2}) {
+        write(version,feature_ptr,{0, 1, 2, 0},weights);
+        TemporallyExtendedModel TEM;
+        ASSERT_TRUE(TEM.load(file_name));
+        const auto & feature_set = TEM.get_feature_set();
+        ASSERT_EQ(feature_set.size(),3);
+        for(int feature_idx=0; feature_idx<3; ++feature_idx) {
+            EXPECT_EQ(feature_set.weight(feature_idx),weights[feature_idx]);
+        }
+        // version 1 uses all combinations of observations and rewards,
+        // version 2 the stored (observed) outcomes
+        EXPECT_EQ(Predictor(TEM).outcome_number(),version==1 ? 4 : 2);
+    }
+    // features that are not canonical (unsorted or repeated basis
+    // features), contradictory, or duplicates are rejected and leave the
+    // model unchanged
+    TemporallyExtendedModel TEM;
+    ASSERT_TRUE(TEM.load(file_name));
+    write(2,feature_ptr,{0, 1, 0, 2},weights);
+    EXPECT_FALSE(TEM.load(file_name));
+    write(2,feature_ptr,{0, 1, 0, 0},weights);
+    EXPECT_FALSE(TEM.load(file_name));
+    write(2,feature_ptr,{0, 1, 0, 3},weights);
+    EXPECT_FALSE(TEM.load(file_name));
+    write(2,feature_ptr,{0, 0, 2, 0},weights);
+    EXPECT_FALSE(TEM.load(file_name));
+    basis_types.push_back(TEM_t::REWARD);
+    basis_times.push_back(0);
+    basis_values.push_back(1);
+    write(2,feature_ptr,{0, 1, 2, 0},weights);
+    EXPECT_FALSE(TEM.load(file_name));
+    EXPECT_EQ(TEM.get_feature_set().size(),3);
+    EXPECT_EQ(TEM.get_feature_set().weight(2),2);
+    std::remove(file_name.c_str());
+}
+
+TEST_F(TemporallyExtendedModelTest, TrajectoryFile) {
+    std::string file_name = ::testing::TempDir()+"ATEM_trajectories";
+    // write as two episodes and read back
+    int split = data.size()/2;
+    std::vector<data_t> episodes(2);
+    episodes[0].assign(data.begin(),data.begin()+split);
+    episodes[1].assign(data.begin()+split,data.end());
+    ASSERT_TRUE(TrajectoryFile::write(file_name,episodes));
+    TrajectoryFile file;
+    ASSERT_TRUE(file.open(file_name));
+    ASSERT_EQ(file.size(),data.size());
+    ASSERT_EQ(file.episode_number(),2u);
+    EXPECT_EQ(file.episode_begin(1),(std::size_t)split);
+    EXPECT_EQ(file.episode_end(1),data.size());
+    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
+        EXPECT_EQ(file.actions()[data_idx],data[data_idx].action);
+        EXPECT_EQ(file.observations()[data_idx],data[data_idx].observation);
+        EXPECT_EQ(file.rewards()[data_idx],data[data_idx].reward);
+    }
+
+    // the view reads the columns in place
+    auto view = file.view();
+    ASSERT_EQ(view.size(),data.size());
+    for(int data_idx=0; data_idx<(int)data.size(); ++data_idx) {
+        EXPECT_EQ(view[data_idx].action,data[data_idx].action);
+        EXPECT_EQ(view[data_idx].observation,data[data_idx].observation);
+        EXPECT_EQ(view[data_idx].reward,data[data_idx].reward);
+    }
+
+    // learning from file and from episodes is the same (the model keeps the
+    // mapping after the file is closed)
+    TemporallyExtendedModel TEM, file_TEM;
+    TEM.set_data(episodes);
+    file_TEM.set_data(file);
+    file.close();
+    std::remove(file_name.c_str());
+    for(int iteration=0; iteration<2; ++iteration) {
+        TEM.expand_feature_set();
+        file_TEM.expand_feature_set();
+    }
+    EXPECT_EQ(TEM.get_feature_set().size(),file_TEM.get_feature_set().size());
+    EXPECT_EQ(TEM.optimize_weights(),file_TEM.optimize_weights());
+}
+
+TEST_F(TemporallyExtendedModelTest, Episodes) {
+    // with every data point being a separate episode there is no history
+    std::vector<data_t> episodes;
+    for(int data_idx=0; data_idx<500; ++data_idx) {
+        episodes.push_back(data_t(1,data[data_idx]));
+    }
+    TemporallyExtendedModel TEM;
+    TEM.set_data(episodes).
+        set_regularization(0.001).
+        set_max_outer_loop_iterations(3).
+        optimize();
+    const auto & feature_set = TEM.get_feature_set();
+    EXPECT_GT(feature_set.size(),0);
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        for(auto basis_idx : feature_set[feature_idx]) {
+            EXPECT_EQ(std::get<1>(feature_set.basis_feature(basis_idx)),0)
+                << "feature " << feature_idx << " refers to the past";
+        }
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, DuplicateContexts) {
+    // repeating the data (as separate episodes) only duplicates contexts,
+    // which does not change the (mean) objective or its gradient
+    data_t part(data.begin(),data.begin()+1000);
+    TemporallyExtendedModel TEM, repeated_TEM;
+    TEM.set_data(part).set_regularization(0.001);
+    repeated_TEM.set_data(std::vector<data_t>(3,part)).set_regularization(0.001);
+    for(int iteration=0; iteration<2; ++iteration) {
+        TEM.expand_feature_set();
+        repeated_TEM.expand_feature_set();
+    }
+    ASSERT_EQ(TEM.get_feature_set().size(),repeated_TEM.get_feature_set().size());
+    EXPECT_NEAR(TEM.optimize_weights(),repeated_TEM.optimize_weights(),1e-6);
+    EXPECT_TRUE(repeated_TEM.check_derivatives());
+}
+
+TEST_F(TemporallyExtendedModelTest, SupportAdmission) {
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).
+        set_admission_score(TemporallyExtendedModel::SUPPORT).
+        set_max_candidates(20);
+    // 6 seeds (observations and rewards, actions alone do not refer to the
+    // outcome) all admitted, then 20 candidates
+    TEM.expand_feature_set();
+    EXPECT_EQ(TEM.get_feature_set().size(),6);
+    TEM.optimize_weights();
+    TEM.expand_feature_set();
+    EXPECT_EQ(TEM.get_feature_set().size(),26);
+    // admitted candidates have at least the support of the rejected ones,
+    // which are all contained in the full expansion
+    TemporallyExtendedModel full_TEM;
+    full_TEM.set_data(data);
+    full_TEM.expand_feature_set();
+    full_TEM.expand_feature_set();
+    TEM.update_outcome_indices();
+    std::vector<int> admitted, rejected;
+    for(int feature_idx=6; feature_idx<full_TEM.feature_set.size(); ++feature_idx) {
+        auto feature = full_TEM.feature_set[feature_idx];
+        std::vector<int> basis;
+        for(auto basis_idx : feature) {
+            basis.push_back(TEM.feature_set.basis_index(full_TEM.feature_set.basis_feature(basis_idx)));
+        }
+        int idx = TEM.feature_set.find(basis.data(),basis.data()+basis.size());
+        if(idx>=0) {
+            admitted.push_back(idx);
+        } else {
+            rejected.push_back(TEM.feature_set.insert(basis.data(),basis.data()+basis.size()));
+        }
+    }
+    ASSERT_EQ(admitted.size(),20u);
+    std::vector<double> admitted_support, rejected_support;
+    TEM.candidate_support(admitted,admitted_support);
+    TEM.candidate_support(rejected,rejected_support);
+    EXPECT_GE(*std::min_element(admitted_support.begin(),admitted_support.end()),
+              *std::max_element(rejected_support.begin(),rejected_support.end()));
+}
+
+TEST_F(TemporallyExtendedModelTest, MinSupport) {
+    // pruning never-active candidates does not change the likelihood
+    TemporallyExtendedModel full_TEM, TEM, strict_TEM;
+    full_TEM.set_data(data).set_min_support(0);
+    TEM.set_data(data);
+    strict_TEM.set_data(data).set_min_support(data.size()/4);
+    for(auto model : {&full_TEM, &TEM, &strict_TEM}) {
+        model->expand_feature_set();
+        model->expand_feature_set();
+    }
+    EXPECT_LE(TEM.get_feature_set().size(),full_TEM.get_feature_set().size());
+    EXPECT_LT(strict_TEM.get_feature_set().size(),TEM.get_feature_set().size());
+    EXPECT_NEAR(full_TEM.optimize_weights(),TEM.optimize_weights(),1e-5);
+    // all remaining candidates (after the 6 seeds) are active often enough
+    std::vector<int> candidates(strict_TEM.feature_set.size()-6);
+    std::iota(candidates.begin(),candidates.end(),6);
+    std::vector<long> counts;
+    strict_TEM.support_counts(candidates,false,counts);
+    for(auto count : counts) {
+        EXPECT_GE(count,(long)data.size()/4);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, WarmStart) {
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).set_regularization(1e-3);
+    TEM.expand_feature_set();
+    TEM.expand_feature_set();
+    double likelihood = TEM.optimize_weights();
+    // removing features with zero weight keeps the optimum
+    int feature_n = TEM.get_feature_set().size();
+    TEM.shrink_feature_set();
+    EXPECT_LT(TEM.get_feature_set().size(),feature_n);
+    EXPECT_EQ(TEM.optimize_weights(),likelihood);
+    // changed weights or regularization require a new optimization
+    TEM.set_regularization(0);
+    EXPECT_GE(TEM.optimize_weights(),likelihood);
+}
+
+TEST_F(TemporallyExtendedModelTest, RegularizationPath) {
+    std::vector<double> regularizations = {1e-4, 1e-2, 1e-3};
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).set_max_outer_loop_iterations(2);
+    std::vector<double> callback_regularizations;
+    auto likelihoods = TEM.optimize_path(regularizations,[&](const TemporallyExtendedModel & model){
+            callback_regularizations.push_back(model.regularization);
+        });
+    // processed from strong to weak
+    EXPECT_EQ(callback_regularizations,std::vector<double>({1e-2, 1e-3, 1e-4}));
+    // weaker regularization gives larger likelihood
+    ASSERT_EQ(likelihoods.size(),3u);
+    EXPECT_GT(likelihoods[0],likelihoods[2]);
+    EXPECT_GT(likelihoods[2],likelihoods[1]);
+    // the model for the weakest regularization does not depend on the
+    // stronger ones
+    auto weakest_features = TEM.get_feature_set().size();
+    TemporallyExtendedModel single_TEM;
+    single_TEM.set_data(data).set_max_outer_loop_iterations(2);
+    auto single_likelihood = single_TEM.optimize_path({1e-4});
+    ASSERT_EQ(single_likelihood.size(),1u);
+    EXPECT_EQ(single_TEM.get_feature_set().size(),weakest_features);
+    EXPECT_NEAR(single_likelihood[0],likelihoods[0],1e-4*likelihoods[0]);
+    // a single point is the same as optimize()
+    double likelihood = TemporallyExtendedModel().
+        set_data(data).
+        set_regularization(1e-4).
+        set_max_outer_loop_iterations(2).
+        optimize();
+    EXPECT_EQ(single_likelihood[0],likelihood);
+}
+
+TEST_F(TemporallyExtendedModelTest, LargeWeights) {
+    // objective and gradient remain finite for weights where exp() overflows
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data);
+    TEM.expand_feature_set();
+    TEM.expand_feature_set();
+    TEM.update_F_matrices();
+    int feature_n = TEM.feature_set.size();
+    std::vector<double> weights(feature_n), gradient(feature_n);
+    for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+        weights[feature_idx] = feature_idx%2==0 ? 1000 : -1000;
+    }
+    double objective = TemporallyExtendedModel::neg_log_likelihood(&TEM,weights.data(),gradient.data(),feature_n);
+    EXPECT_TRUE(std::isfinite(objective));
+    for(auto g : gradient) {
+        EXPECT_TRUE(std::isfinite(g));
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, LineSearch) {
+    // objective and gradient at points along a search line (linear terms
+    // interpolated) are the same as when computed from scratch
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data);
+    TEM.expand_feature_set();
+    TEM.expand_feature_set();
+    TEM.update_F_matrices();
+    int feature_n = TEM.feature_set.size();
+    std::vector<double> w_0(feature_n), direction(feature_n), w(feature_n);
+    std::vector<double> gradient(feature_n), expected_gradient(feature_n);
+    for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+        w_0[feature_idx] = 0.1*(feature_idx%5)-0.2;
+        direction[feature_idx] = 0.3*(feature_idx%3)-0.3;
+    }
+    TemporallyExtendedModel::neg_log_likelihood(&TEM,w_0.data(),gradient.data(),feature_n,0);
+    for(double step : {1., 0.5, 0.25, 0.125}) {
+        for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+            w[feature_idx] = w_0[feature_idx]+step*direction[feature_idx];
+        }
+        double objective = TemporallyExtendedModel::neg_log_likelihood(&TEM,w.data(),gradient.data(),feature_n,step);
+        TemporallyExtendedModel reference_TEM = TEM;
+        double expected_objective = TemporallyExtendedModel::neg_log_likelihood(&reference_TEM,w.data(),expected_gradient.data(),feature_n,0);
+        EXPECT_NEAR(objective,expected_objective,1e-10);
+        for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+            EXPECT_NEAR(gradient[feature_idx],expected_gradient[feature_idx],1e-10);
+        }
+        // the first probe is computed, the others are interpolated
+        EXPECT_EQ(TEM.last_lin_idx,step==1?1:2);
+    }
+    // the next search line starts at the last (interpolated) probe
+    for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+        w_0[feature_idx] = w[feature_idx];
+        direction[feature_idx] = 0.2*(feature_idx%4)-0.3;
+    }
+    for(double step : {1., 0.5}) {
+        for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+            w[feature_idx] = w_0[feature_idx]+step*direction[feature_idx];
+        }
+        double objective = TemporallyExtendedModel::neg_log_likelihood(&TEM,w.data(),gradient.data(),feature_n,step);
+        EXPECT_EQ(TEM.last_lin_idx,step==1?1:2);
+        TemporallyExtendedModel reference_TEM = TEM;
+        double expected_objective = TemporallyExtendedModel::neg_log_likelihood(&reference_TEM,w.data(),expected_gradient.data(),feature_n,0);
+        EXPECT_NEAR(objective,expected_objective,1e-10);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, OutcomeIndependentFeatures) {
+    // features that do not refer to the outcome are never generated
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data);
+    for(int iteration=0; iteration<3; ++iteration) {
+        TEM.expand_feature_set();
+    }
+    const auto & feature_set = TEM.get_feature_set();
+    for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+        auto feature = feature_set[feature_idx];
+        EXPECT_TRUE(feature_set.refers_to_outcome(feature.begin(),feature.end()));
+    }
+    // For a fixed feature set, adding such features does not change the
+    // objective and their gradient is zero (up to rounding). The learned
+    // models may still differ because rounding can give them non-zero
+    // weights without regularization, which keeps them (and their
+    // candidates) in the feature set.
+    TEM.optimize_weights();
+    TemporallyExtendedModel extended_TEM = TEM;
+    int feature_n = TEM.feature_set.size();
+    for(int action=0; action<3; ++action) {
+        int basis_idx = extended_TEM.feature_set.intern(TemporallyExtendedModel::basis_feature_t(TemporallyExtendedModel::ACTION,0,action));
+        extended_TEM.feature_set.insert(&basis_idx,&basis_idx+1);
+    }
+    extended_TEM.update_F_matrices();
+    int extended_n = extended_TEM.feature_set.size();
+    ASSERT_EQ(extended_n,feature_n+3);
+    std::vector<double> weights = TEM.feature_set.weights(), gradient(feature_n);
+    std::vector<double> extended_weights = extended_TEM.feature_set.weights(), extended_gradient(extended_n);
+    double objective = TemporallyExtendedModel::neg_log_likelihood(&TEM,weights.data(),gradient.data(),feature_n);
+    double extended_objective = TemporallyExtendedModel::neg_log_likelihood(&extended_TEM,extended_weights.data(),extended_gradient.data(),extended_n);
+    EXPECT_NEAR(objective,extended_objective,1e-12);
+    for(int feature_idx=0; feature_idx<feature_n; ++feature_idx) {
+        EXPECT_NEAR(gradient[feature_idx],extended_gradient[feature_idx],1e-12);
+    }
+    for(int feature_idx=feature_n; feature_idx<extended_n; ++feature_idx) {
+        EXPECT_NEAR(extended_gradient[feature_idx],0,1e-12);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, ObservedOutcomes) {
+    // restricting outcomes to observed pairs removes probability mass from
+    // pairs that never occur so the likelihood cannot decrease
+    TemporallyExtendedModel TEM, observed_TEM;
+    TEM.set_data(data);
+    observed_TEM.set_data(data).set_observed_outcomes(true);
+    EXPECT_LT(observed_TEM.outcome_number(),TEM.outcome_number());
+    for(int iteration=0; iteration<2; ++iteration) {
+        TEM.expand_feature_set();
+        observed_TEM.expand_feature_set();
+    }
+    EXPECT_GE(observed_TEM.optimize_weights(),TEM.optimize_weights()-1e-4);
+    EXPECT_TRUE(observed_TEM.check_derivatives());
+    Predictor predictor(observed_TEM);
+    auto distributions = observed_TEM.get_predictions(data);
+    ASSERT_EQ(predictor.outcome_number(),observed_TEM.outcome_number());
+    for(int data_idx=0; data_idx<100; ++data_idx) {
+        int outcome_idx = predictor.outcome_index(data[data_idx]);
+        ASSERT_GE(outcome_idx,0);
+        EXPECT_NEAR(predictor.probability(data,data_idx),distributions(outcome_idx,data_idx),1e-10);
+    }
+
+    // an outcome slot keeps some probability for unseen outcomes, also after
+    // saving and loading
+    observed_TEM.set_observed_outcomes(true,true);
+    observed_TEM.optimize_weights();
+    std::string file_name = ::testing::TempDir()+"ATEM_observed_model";
+    ASSERT_TRUE(observed_TEM.save(file_name));
+    TemporallyExtendedModel loaded_TEM;
+    ASSERT_TRUE(loaded_TEM.load(file_name));
+    std::remove(file_name.c_str());
+    ASSERT_TRUE(loaded_TEM.has_outcome_slot());
+    ASSERT_EQ(loaded_TEM.outcome_number(),observed_TEM.outcome_number());
+    data_t unseen(data.begin(),data.begin()+10);
+    unseen.back().observation = -1;
+    auto log_likelihoods = loaded_TEM.get_log_likelihoods(unseen);
+    EXPECT_TRUE(std::isfinite(log_likelihoods(9)));
+    EXPECT_NEAR(exp(log_likelihoods(9)),Predictor(observed_TEM).probability(unseen,9),1e-10);
+}
+
+TEST_F(TemporallyExtendedModelTest, MappedOutcomeModes) {
+    // a file written with all outcome combinations is not used for observed
+    // outcomes (and vice versa)
+    std::string file_name = ::testing::TempDir()+"ATEM_outcome_F_matrices";
+    std::remove(file_name.c_str());
+    auto likelihood = [&](bool observed, bool slot, const std::string & file) {
+        TemporallyExtendedModel TEM;
+        TEM.set_data(data).set_observed_outcomes(observed,slot).set_F_matrix_file(file);
+        TEM.expand_feature_set();
+        TEM.expand_feature_set();
+        return TEM.optimize_weights();
+    };
+    double full = likelihood(false,false,""), observed = likelihood(true,false,"");
+    double slot = likelihood(true,true,"");
+    EXPECT_EQ(likelihood(false,false,file_name),full);
+    EXPECT_EQ(likelihood(true,false,file_name),observed);
+    EXPECT_EQ(likelihood(true,true,file_name),slot);
+    EXPECT_EQ(likelihood(false,false,file_name),full);
+    std::remove(file_name.c_str());
+}
+
+TEST_F(TemporallyExtendedModelTest, ContextPacking) {
+    // contexts are only packed into a separate store for in-memory
+    // F-matrices with enough data points per context, otherwise they use the
+    // F-matrices of their first data point with the same result
+    std::string file_name = ::testing::TempDir()+"ATEM_context_F_matrices";
+    std::remove(file_name.c_str());
+    TemporallyExtendedModel in_memory, mapped;
+    in_memory.set_data(data);
+    mapped.set_data(data).set_F_matrix_file(file_name);
+    for(auto TEM : {&in_memory,&mapped}) {
+        TEM->expand_feature_set();
+        TEM->expand_feature_set();
+        TEM->update_F_matrices();
+    }
+    int data_n = in_memory.data.size();
+    int context_n = in_memory.context_data.size();
+    ASSERT_EQ((int)mapped.context_data.size(),context_n);
+    ASSERT_LE(2*context_n,data_n);
+    EXPECT_EQ(in_memory.context_F_matrices(),&in_memory.context_F_store);
+    EXPECT_TRUE(mapped.F_matrices.is_mapped());
+    EXPECT_EQ(mapped.context_F_store.size(),0);
+    EXPECT_EQ(mapped.context_F_matrices(),nullptr);
+    for(int context_idx=0; context_idx<context_n; ++context_idx) {
+        EXPECT_TRUE(in_memory.context_F_matrix(context_idx)==mapped.context_F_matrix(context_idx));
+    }
+    EXPECT_EQ(in_memory.optimize_weights(),mapped.optimize_weights());
+    std::remove(file_name.c_str());
+}
+
+TEST_F(TemporallyExtendedModelTest, ThreadCount) {
+    // feature expansion gives the same features in the same order
+    // independent of the number of threads
+    auto features = [&](int thread_n, int max_candidates) {
+        int default_thread_n = omp_get_max_threads();
+        omp_set_num_threads(thread_n);
+        TemporallyExtendedModel TEM;
+        TEM.set_data(data).set_max_candidates(max_candidates);
+        for(int iteration=0; iteration<3; ++iteration) {
+            TEM.expand_feature_set();
+        }
+        omp_set_num_threads(default_thread_n);
+        const auto & feature_set = TEM.get_feature_set();
+        std::vector<std::vector<FeatureSet::basis_feature_t>> features;
+        for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+            features.emplace_back();
+            for(auto basis_idx : feature_set[feature_idx]) {
+                features.back().push_back(feature_set.basis_feature(basis_idx));
+            }
+        }
+        return features;
+    };
+    for(int max_candidates : {0, 50}) {
+        auto single_thread = features(1,max_candidates);
+        EXPECT_FALSE(single_thread.empty());
+        EXPECT_EQ(features(4,max_candidates),single_thread);
+        EXPECT_EQ(features(7,max_candidates),single_thread);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, IncrementalFMatrices) {
+    // after an expansion, F-matrices with reused rows of surviving features
+    // and newly evaluated rows are the same as when computed from scratch
+    TemporallyExtendedModel TEM;
+    TEM.set_data(data).set_regularization(1e-3);
+    TEM.expand_feature_set();
+    TEM.optimize_weights();
+    TEM.shrink_feature_set();
+    TEM.expand_feature_set();
+    auto old_ids = TEM.F_matrix_feature_ids;
+    TEM.update_F_matrices();
+    int reused_n = 0;
+    for(int feature_idx=0; feature_idx<TEM.feature_set.size(); ++feature_idx) {
+        reused_n += std::count(old_ids.begin(),old_ids.end(),TEM.feature_set.id(feature_idx));
+    }
+    EXPECT_GT(reused_n,0);
+    EXPECT_LT(reused_n,TEM.feature_set.size());
+    TemporallyExtendedModel reference_TEM = TEM;
+    reference_TEM.F_matrices.reset(0,0);
+    reference_TEM.F_matrix_feature_ids.clear();
+    reference_TEM.update_F_matrices();
+    ASSERT_EQ(TEM.F_matrices.size(),reference_TEM.F_matrices.size());
+    ASSERT_EQ(TEM.F_matrices.n_rows(),reference_TEM.F_matrices.n_rows());
+    ASSERT_EQ(TEM.F_matrices.n_cols(),reference_TEM.F_matrices.n_cols());
+    for(int data_idx=0; data_idx<TEM.F_matrices.size(); ++data_idx) {
+        EXPECT_TRUE(TEM.F_matrices[data_idx]==reference_TEM.F_matrices[data_idx]);
+    }
+}
+
+TEST_F(TemporallyExtendedModelTest, CandidateBlocks) {
+    // admitting candidates in small blocks (only scoring the new ones) gives
+    // the same features as admitting them all at once
+    auto features = [&](int block_size, TemporallyExtendedModel::ADMISSION_SCORE score) {
+        TemporallyExtendedModel TEM;
+        TEM.set_data(data).set_max_candidates(20).set_admission_score(score);
+        TEM.candidate_block_size = block_size;
+        std::vector<std::vector<FeatureSet::basis_feature_t>> features;
+        for(int iteration=0; iteration<3; ++iteration) {
+            TEM.expand_feature_set();
+        }
+        const auto & feature_set = TEM.get_feature_set();
+        for(int feature_idx=0; feature_idx<feature_set.size(); ++feature_idx) {
+            features.emplace_back();
+            for(auto basis_idx : feature_set[feature_idx]) {
+                features.back().push_back(feature_set.basis_feature(basis_idx));
+            }
+        }
+        return features;
+    };
+    for(auto score : {TemporallyExtendedModel::GRADIENT, TemporallyExtendedModel::SUPPORT}) {
+        auto all_at_once = features(1<<16,score);
+        EXPECT_GT(all_at_once.size(),20u);
+        EXPECT_EQ(features(7,score),all_at_once);
+        EXPECT_EQ(features(1,score),all_at_once);
+    }
+}